@@ -1,4 +1,8 @@
 #include "AGCMonitor.h"
+#include "IFSink.h"
+#include "Reactor.h"
+#include "SiGeModes.h"
+#include "Tracer.h"
 
 #include <algorithm>
 #include <csignal>
@@ -6,32 +10,78 @@
 #include <gflags/gflags.h>
 #include <iostream>
 #include <fstream>
+#include <memory>
 #include <sstream>
+#include <unistd.h>
+
+DEFINE_bool(skipagc, false, "Skips the collection of AGC data.");
+DEFINE_string(ifshm, "",
+              "If set, also publishes the packed IF data in a POSIX shared memory ring of this name (e.g. '/sige_if') for live consumers.");
+
+static bool ValidateIFShmSlots(const char *flagname, uint32_t slots) {
+    if (slots > 0) {
+        return true;
+    }
+    std::cerr << "--" << flagname << " must not be 0." << std::endl;
+    return false;
+}
+
+DEFINE_uint32(ifshmslots, 1024,
+              "Number of packed IF buffers kept in the shared memory ring.");
+DEFINE_validator(ifshmslots, ValidateIFShmSlots);
+DEFINE_string(ifsocket, "",
+              "If set, also streams the packed IF data to subscribers of a Unix socket at this path.");
+DEFINE_string(stripedirs, "",
+              "Comma separated directories, ideally on different devices, to stripe the IF data over instead of writing a single file. Disables the circular file.");
+DEFINE_uint32(stripechunk, 1024, "Size in KB of each striped chunk.");
 
 static bool
-ValidateLookupTable(const char *flagname, const std::string &lookup_table_str) {
-    std::stringstream ss(lookup_table_str);
-    std::vector<char> lookup_table(4);
-    for (unsigned i = 0; i < lookup_table.size(); ++i) {
-        int num;
-        ss >> num;
-        lookup_table[i] = static_cast<char>(num);
-    }
-    std::sort(lookup_table.begin(), lookup_table.end());
-    if (ss.eof() && lookup_table[0] == -3 && lookup_table[1] == -1 &&
-        lookup_table[2] == 1 && lookup_table[3] == 3) {  // Lookup table ok.
+ValidateStripePlacement(const char *flagname, const std::string &placement) {
+    if (placement == "roundrobin" || placement == "latency") {
         return true;
     }
-    std::cerr << "--" << flagname
-              << " must include numbers -3, -1, 1 and 3 once each."
+    std::cerr << "--" << flagname << " must be roundrobin or latency."
               << std::endl;
     return false;
 }
 
-DEFINE_string(lookuptable, "1 3 -3 -1",
-              "Lookup table to use when mapping two bits to bytes in unpacked mode. Defaults to '1 3 -3 -1'");
-DEFINE_validator(lookuptable, ValidateLookupTable);
-DEFINE_bool(skipagc, false, "Skips the collection of AGC data.");
+DEFINE_string(stripeplacement, "latency",
+              "How striped chunks are placed: roundrobin or latency (the target expected to be done soonest).");
+DEFINE_validator(stripeplacement, ValidateStripePlacement);
+DEFINE_uint32(ifwritekb, 0,
+              "Size in KB of the writes to the IF file, 0 writes every packed buffer as it comes. See SiGeStorageBench.");
+DEFINE_bool(ifdirect, false,
+            "Writes the IF file with O_DIRECT, in writes of at least 4 KB.");
+
+static bool ValidateIFSync(const char *flagname, const std::string &sync) {
+    if (sync == "none" || sync == "range" || sync == "data") {
+        return true;
+    }
+    std::cerr << "--" << flagname << " must be none, range or data."
+              << std::endl;
+    return false;
+}
+
+DEFINE_string(ifsync, "none",
+              "Writeback of the IF file every --ifsyncmb: none (left to the kernel), range (sync_file_range, asynchronous) or data (fdatasync).");
+DEFINE_validator(ifsync, ValidateIFSync);
+DEFINE_uint32(ifsyncmb, 8, "MB written between IF file syncs.");
+DEFINE_bool(fused, false,
+            "Packs the IF data in the USB transfer callback and batches it to the writer, instead of using a packing thread. Lighter on a single core.");
+DEFINE_uint32(fusedbatchkb, 256,
+              "Fused mode: KB of packed IF data per batch handed to the writer.");
+DEFINE_uint32(fusedringmb, 16,
+              "Fused mode: MB of batches the writer may fall behind by.");
+DEFINE_bool(fusedfatal, false,
+            "Fused mode: stops the recording when the writer falls behind by --fusedringmb, instead of dropping IF data until it catches up.");
+DEFINE_bool(trace, true,
+            "Keeps a flight recorder of hot path events, dumped to <logname>_TRACE_<time>.bin on errors and on stop.");
+DEFINE_uint32(tracerecords, 65536, "Trace events kept per thread.");
+DEFINE_double(traceseconds, 10, "Seconds of trace events kept in a dump.");
+DEFINE_uint32(quicklook, 10,
+              "Period in seconds of the quick-look spectrum and sample statistics summary in the log, 0 disables it.");
+DEFINE_double(quicklookbudget, 2.0,
+              "Percentage of one core the quick-look monitor may use.");
 
 #define CHECK_LIBUSB_ERR(error)                                                         \
     do{                                                                                 \
@@ -39,7 +89,8 @@ DEFINE_bool(skipagc, false, "Skips the collection of AGC data.");
         if(err < 0) {                                                                   \
             std::cerr << libusb_strerror(static_cast<libusb_error>(err)) << std::endl;  \
             std::cerr << __FUNCTION__ << ":" << __LINE__ << ": Exit." << std::endl;     \
-            raise(SIGTERM);                                                             \
+            Tracer::Dump(libusb_strerror(static_cast<libusb_error>(err)));              \
+            kill(getpid(), SIGTERM);                                                    \
         }                                                                               \
     } while(0)
 
@@ -48,7 +99,8 @@ DEFINE_bool(skipagc, false, "Skips the collection of AGC data.");
         std::cerr << std::chrono::duration_cast<std::chrono::seconds>(                    \
                      std::chrono::system_clock::now().time_since_epoch()).count();        \
         std::cerr << ":" << __FUNCTION__ << ":" << __LINE__ << ": " << msg << std::endl;  \
-        raise(SIGTERM);                                                                   \
+        Tracer::Dump(msg);                                                                \
+        kill(getpid(), SIGTERM);                                                          \
     } while(0)
 
 namespace {
@@ -97,6 +149,7 @@ namespace {
     // OS might have. Our process might not be scheduled every time we want it
     // to be. With 256 transfers a normal priority 12h test failed, but a max
     // priority test ran ok. With 768, a normal priority 12h test ran ok.
+    // SiGeSoak measures this for other loads, see SetTransfers.
     constexpr unsigned int kNumberOfTransfers = 768;
     // Apart from having many transfers queued, the transfers need to have a big
     // enough buffer that they don't bash the callback too often, causing a
@@ -109,67 +162,123 @@ namespace {
     // Timeout on the USB handling call. The timeout helps with reducing CPU
     // usage because the USB handling call is done in a while true loop.
     constexpr unsigned int kUSBHandleTimeout = 1000;
+    // How long a mode change may wait for the cancelled IF transfers.
+    constexpr unsigned int kDrainTimeout = 2000;
 
     constexpr int64_t kMaxCircularIFSize = 1024ll * 1024 * 1024 * 50;  // 50 GB
 
     // Masks
     constexpr uint8_t k2BitMask = 0x03;
     constexpr uint8_t k4BitMask = 0x0F;
+}  // namespace
 
-    // Loookup table for unpacked mode.
-    char lut[] = {0, 1, 2, 3};
-
-    void SetLookupTable() {
-        std::stringstream ss(FLAGS_lookuptable);
-        for (unsigned i = 0; i < sizeof lut; ++i) {
-            int num;
-            ss >> num;
-            lut[i] = static_cast<char>(num);
+// Packs size unpacked samples, 4 real or 2 complex ones per byte. Returns the
+// packed size, 0 if the mode's packing is unknown.
+static size_t PackIF(const uint8_t *unpacked, const size_t size,
+                     const SiGeMode &mode, uint8_t *packed) {
+    // Packs 1x4 samples in 1 byte (for real data)
+    if (mode.pack_mode == 4 && !mode.is_complex) {
+        for (size_t offset = 0, buffer_index = 0;
+             offset < size; offset += 4, ++buffer_index) {
+            packed[buffer_index] = (unpacked[offset] & k2BitMask) |
+                                   ((unpacked[offset + 1] & k2BitMask) << 2) |
+                                   ((unpacked[offset + 2] & k2BitMask) << 4) |
+                                   ((unpacked[offset + 3] & k2BitMask) << 6);
         }
+        return size / 4;
+        // Packs 2x2 samples in 1 byte (for complex data)
+    } else if (mode.pack_mode == 2 && mode.is_complex) {
+        for (size_t offset = 0, buffer_index = 0;
+             offset < size; offset += 2, ++buffer_index) {
+            packed[buffer_index] = (unpacked[offset] & k4BitMask) |
+                                   ((unpacked[offset + 1] & k4BitMask) << 4);
+        }
+        return size / 2;
     }
-}  // namespace
+    return 0;
+}
 
 // Callback that handles asynchronous USB transfer events (IF data).
 // Simply copies the transfer's buffer and puts it into AGCMonitor's IF queue.
 static void IFTransferCallback(libusb_transfer *transfer) {
+    TRACE_EVENT(TraceEvent::kTransferComplete, transfer->actual_length);
+    AGCMonitor *monitor = (AGCMonitor *) transfer->user_data;
+    if (monitor->IsDrainingIFTransfers()) {
+        // Cancelled or cut short by a mode change, keep what packs whole.
+        int length = transfer->actual_length - transfer->actual_length % 4;
+        if (length > 0) {
+            monitor->PushIFBufferIntoQueue(transfer->buffer, length);
+        }
+        monitor->IFTransferDrained();
+        return;
+    }
+
     if (transfer->status != LIBUSB_TRANSFER_COMPLETED) {
         auto time = std::chrono::duration_cast<std::chrono::seconds>(
                 std::chrono::system_clock::now().time_since_epoch()).count();
         std::cerr << "IF transfer error at " << time
                   << ". Transfer not completed." << std::endl;
-        raise(SIGTERM);
+        Tracer::Dump("IF transfer not completed");
+        kill(getpid(), SIGTERM);
     }
 
     auto actual_length = transfer->actual_length;
-    if (actual_length != kIFTransferBufferSize) {
+    if (actual_length != transfer->length) {
         auto time = std::chrono::duration_cast<std::chrono::seconds>(
                 std::chrono::system_clock::now().time_since_epoch()).count();
         std::cerr << "IF transfer error at " << time << ". Got "
                   << actual_length << " instead of "
-                  << kIFTransferBufferSize
+                  << transfer->length
                   << " bytes." << std::endl;
-        raise(SIGTERM);
+        Tracer::Dump("IF transfer short");
+        kill(getpid(), SIGTERM);
     }
 
-    AGCMonitor *monitor = (AGCMonitor *) transfer->user_data;
-    monitor->PushIFBufferIntoQueue(transfer->buffer, kIFTransferBufferSize);
-    CHECK_LIBUSB_ERR(libusb_submit_transfer(transfer));
+    monitor->PushIFBufferIntoQueue(transfer->buffer, transfer->length);
+    TRACE_EVENT(TraceEvent::kTransferResubmit, transfer->length);
+    CHECK_LIBUSB_ERR(monitor->ResubmitIFTransfer(transfer));
+}
+
+// Called by the reactor when libusb's fds have events, so it doesn't block.
+static void HandleUSBEvents(uint32_t) {
+    timeval tv = {0, 0};
+    libusb_handle_events_timeout_completed(nullptr /* context */, &tv,
+                                           nullptr /* completed */);
+}
+
+static void USBPollfdAdded(int fd, short events, void *user_data) {
+    // poll and epoll share the values of the flags libusb uses.
+    static_cast<Reactor *>(user_data)->Watch(fd, static_cast<uint16_t>(events),
+                                             HandleUSBEvents);
+}
+
+static void USBPollfdRemoved(int fd, void *user_data) {
+    static_cast<Reactor *>(user_data)->Unwatch(fd);
 }
 
 AGCMonitor::AGCMonitor() {
-    if (!lookuptable_validator_registered) {
+    if (!stripeplacement_validator_registered || !ifsync_validator_registered ||
+        !ifshmslots_validator_registered) {
         // Do nuthn.
     }
     // Set parameters to their default values
+    is_draining_if_transfers_ = false;
+    if_transfers_in_flight_ = 0;
+    is_fused_ = false;
+    fused_filling_ = 0;
+    fused_published_ = 0;
+    is_fused_ring_full_ = false;
     SetMode(8);
+    SetTransfers(kNumberOfTransfers, kIFTransferBufferSize);
     name_log_ = "data/test";
+    reactor_ = nullptr;
+    usb_timeout_timer_ = -1;
 
     //initialization of variables
     is_device_init_ = false;
     is_recording_ = false;
     circular_if_file_ = true;
     stop_request_ = false;
-    SetLookupTable();
 }
 
 AGCMonitor::~AGCMonitor(void) {
@@ -180,76 +289,74 @@ AGCMonitor::~AGCMonitor(void) {
 
 void
 AGCMonitor::PushIFBufferIntoQueue(const uint8_t *buffer, const size_t size) {
-    std::vector<uint8_t> unpacked_if(buffer, buffer + size);
+    if (is_fused_) {
+        PackIntoFusedRing(buffer, size);
+        return;
+    }
+    IFBuffer unpacked_if = {mode_, std::vector<uint8_t>(buffer, buffer + size)};
     mutex_unpacked_if_queue_.lock();
-    unpacked_IF_queue_.push(unpacked_if);
+    unpacked_IF_queue_.push(std::move(unpacked_if));
+    TRACE_EVENT(TraceEvent::kUnpackedQueuePush, unpacked_IF_queue_.size());
     mutex_unpacked_if_queue_.unlock();
     semaphore_unpacked_if_queue_.notify();
 }
 
+bool AGCMonitor::IsDrainingIFTransfers() {
+    return is_draining_if_transfers_;
+}
+
+void AGCMonitor::IFTransferDrained() {
+    std::lock_guard<std::mutex> lock(mutex_if_transfers_);
+    --if_transfers_in_flight_;
+    condition_if_transfers_drained_.notify_all();
+}
+
+int AGCMonitor::ResubmitIFTransfer(libusb_transfer *transfer) {
+    {
+        // ChangeMode sets the flag with the lock held, so once it is set
+        // nothing gets resubmitted behind the cancellations.
+        std::lock_guard<std::mutex> lock(mutex_if_transfers_);
+        if (!is_draining_if_transfers_) {
+            return libusb_submit_transfer(transfer);
+        }
+    }
+    IFTransferDrained();
+    return LIBUSB_SUCCESS;
+}
+
 void AGCMonitor::SetMode(const unsigned char mode) {
-    switch (mode) {
-        // Modes 1, 3, 5, 7 have an IF of 4.1304e6.
-        // Modes 2, 4, 6, 8 have an IF of 4.092e6.
-        // Lower four modes are wideband. Upper narrowband.
-        case 1: //	mode 1
-            fw_mode_ = 32;
-            // freqsampling_ = 16367600;
-            is_complex_data_ = false;
-            pack_mode_ = 4;
-            break;
-        case 2: //	mode 2
-            fw_mode_ = 36;
-            // freqsampling_ = 8183800;
-            is_complex_data_ = true;
-            pack_mode_ = 2;
-            break;
-        case 3: //	mode 3
-            fw_mode_ = 38;
-            // freqsampling_ = 5455867;
-            is_complex_data_ = false;
-            pack_mode_ = 4;
-            break;
-        case 4: //  mode 4
-            fw_mode_ = 42;
-            // freqsampling_ = 4091900;
-            is_complex_data_ = true;
-            pack_mode_ = 2;
-            break;
-        case 5: //	mode 5
-            fw_mode_ = 132;
-            // freqsampling_ = 16367600;
-            is_complex_data_ = false;
-            pack_mode_ = 4;
-            break;
-        case 6: //	mode 6
-            fw_mode_ = 136;
-            // freqsampling_ = 8183800;
-            is_complex_data_ = true;
-            pack_mode_ = 2;
-            break;
-        case 7: // 	mode 7
-            fw_mode_ = 138;
-            // freqsampling_ = 5455867;
-            is_complex_data_ = false;
-            pack_mode_ = 4;
-            break;
-        case 8: //  mode 8
-            fw_mode_ = 142;
-            // freqsampling_ = 4091900;
-            is_complex_data_ = true;
-            pack_mode_ = 2;
-            break;
-        default:
-            ERROR_EXIT("Invalid devmode!");
+    const SiGeMode *sige_mode = FindSiGeMode(mode);
+    if (sige_mode == nullptr) {
+        ERROR_EXIT("Invalid devmode!");
+        return;
+    }
+    mode_ = sige_mode;
+}
+
+void AGCMonitor::RequestModeChange(const unsigned char mode) {
+    if (FindSiGeMode(mode) == nullptr) {
+        std::cerr << time(nullptr) << " [" << name_log_ << "]"
+                  << "Ignoring change to invalid devmode "
+                  << static_cast<int>(mode) << "." << std::endl;
+        return;
     }
-    // freqagc_ = 97.5;
+    std::lock_guard<std::mutex> lock(mutex_requested_modes_);
+    requested_modes_.push(mode);
+}
+
+void AGCMonitor::SetTransfers(const unsigned count, const unsigned buffer_size) {
+    number_of_transfers_ = count;
+    if_transfer_buffer_size_ = buffer_size;
 }
 
 void AGCMonitor::SetLogName(const std::string &nm) {
     name_log_ = nm;
 }
 
+void AGCMonitor::SetReactor(Reactor *reactor) {
+    reactor_ = reactor;
+}
+
 void AGCMonitor::OpenDevice() {
     device_handle_ = libusb_open_device_with_vid_pid(nullptr /* context */,
                                                      kVendorId, kProductId);
@@ -289,15 +396,17 @@ void AGCMonitor::StartRecording() {
         USRPTransfer(kOutVendorDeviceRequestINTransfer, 0);
         USRPTransfer(kOutVendorDeviceRequestINTransfer, 1);
         USRPTransfer2(kInVendorDeviceRequestFlags, 0, 5, uc_flags);
-        USRPTransfer(kOutVendorDeviceRequestINTransfer, 0);
-        USRPTransfer(kOutVendorDeviceRequestCMode, fw_mode_);
-        USRPTransfer(kOutVendorDeviceRequestINTransfer, 1);
-        USRPTransfer(kOutVendorDeviceRequestAGC, 2);
-
-        USRPTransfer(kOutVendorDeviceRequestAGC, 1);
-        USRPTransfer(kOutVendorDeviceRequestAGC, 2);
-        USRPTransfer2(kInVendorDeviceRequestFlags, 0, 5, uc_flags);
-        USRPTransfer(kOutVendorDeviceRequestAGC, 2);
+        ConfigureFrontend(*mode_.load());
+
+        if (FLAGS_trace) {
+            auto time_v = std::chrono::duration_cast<std::chrono::seconds>(
+                    std::chrono::system_clock::now().time_since_epoch()).count();
+            char buf[64];
+            strftime(buf, sizeof(buf), "%Y-%m-%dT%H-%M-%S",
+                     gmtime(reinterpret_cast<time_t *>(&time_v)));
+            Tracer::Enable(FLAGS_tracerecords, FLAGS_traceseconds,
+                           "/" + name_log_ + "_TRACE_" + buf + ".bin");
+        }
 
         // Start all threads.
         stop_request_ = false;
@@ -306,11 +415,38 @@ void AGCMonitor::StartRecording() {
         thread_write_agc_to_file_ = std::thread(
                 &AGCMonitor::WriteAGCAndAGCTSToFileThread,
                 this);
+        is_fused_ = FLAGS_fused;
+        if (is_fused_) {
+            // Batches take the largest packed buffer, complex data packs the
+            // least.
+            size_t batch_size = std::max<size_t>(FLAGS_fusedbatchkb * 1024,
+                                                 if_transfer_buffer_size_ / 2);
+            size_t batch_count = std::max<size_t>(
+                    (static_cast<size_t>(FLAGS_fusedringmb) << 20) / batch_size,
+                    3);
+            fused_ring_.assign(batch_count,
+                               {mode_, std::vector<uint8_t>(batch_size), 0,
+                                0});
+            fused_filling_ = 0;
+            fused_published_ = 0;
+            is_fused_ring_full_ = false;
+        }
         thread_write_if_to_file_ = std::thread(
                 &AGCMonitor::WriteIFToFileThread,
                 this);
-        thread_async_usb_ = std::thread(&AGCMonitor::AsyncUSBThread, this);
-        thread_if_packing_ = std::thread(&AGCMonitor::IFPackingThread, this);
+        if (reactor_ != nullptr) {
+            // StartRecording runs on the reactor's thread.
+            Tracer::SetThreadName("Reactor");
+            WatchUSBEvents();
+        } else {
+            thread_async_usb_ = std::thread(&AGCMonitor::AsyncUSBThread,
+                                            this);
+        }
+        if (!is_fused_) {
+            thread_if_packing_ = std::thread(&AGCMonitor::IFPackingThread,
+                                             this);
+        }
+        quick_look_.Start(name_log_, FLAGS_quicklook, FLAGS_quicklookbudget);
         is_recording_ = true;
 
         std::cerr << "[" << name_log_ << "]" << "Start recording." << std::endl;
@@ -320,15 +456,41 @@ void AGCMonitor::StartRecording() {
 void AGCMonitor::StopRecording() {
     if (is_recording_) {
         stop_request_ = true;
+        if (is_fused_) {
+            // The callbacks drop everything from now on, write the rest.
+            std::lock_guard<std::mutex> lock(mutex_fused_ring_);
+            const FusedBatch &batch = fused_ring_[fused_filling_];
+            if (batch.size > 0 || batch.dropped > 0) {
+                PublishFusedBatch();
+            }
+        }
         semaphore_agc_agcts_queue_.notify();
         semaphore_packed_if_queue_.notify();
         semaphore_unpacked_if_queue_.notify();
+        {
+            // A mode change waiting for the transfers to drain gives up.
+            std::lock_guard<std::mutex> lock(mutex_if_transfers_);
+            condition_if_transfers_drained_.notify_all();
+        }
+
+        if (reactor_ != nullptr) {
+            UnwatchUSBEvents();
+        } else {
+            // Don't wait for the handling call to time out.
+            libusb_interrupt_event_handler(nullptr /* context */);
+            thread_async_usb_.join();
+        }
 
         thread_agc_and_overrun_.join();
         thread_write_agc_to_file_.join();
         thread_write_if_to_file_.join();
-        thread_async_usb_.join();
-        thread_if_packing_.join();
+        if (thread_if_packing_.joinable()) {
+            thread_if_packing_.join();
+        }
+        ReleaseIFTransfers();
+        quick_look_.Stop();
+        Tracer::Dump("stop");
+        Tracer::Disable();
 
         is_recording_ = false;
 
@@ -340,7 +502,7 @@ void AGCMonitor::StopRecording() {
 }
 
 void AGCMonitor::AllocateAndSubmitIFTransfers() {
-    for (unsigned i = 0; i < kNumberOfTransfers; ++i) {
+    for (unsigned i = 0; i < number_of_transfers_; ++i) {
         libusb_transfer *if_transfer = libusb_alloc_transfer(
                 0 /* iso packets num */);
         if (if_transfer == nullptr) {
@@ -348,14 +510,65 @@ void AGCMonitor::AllocateAndSubmitIFTransfers() {
             exit(1);
         }
         libusb_fill_bulk_transfer(if_transfer, device_handle_, kIFEndpoint,
-                                  new uint8_t[kIFTransferBufferSize],
-                                  kIFTransferBufferSize, IFTransferCallback,
+                                  new uint8_t[if_transfer_buffer_size_],
+                                  if_transfer_buffer_size_, IFTransferCallback,
                                   this /* user data */, kBulkTransferTimeout);
+        if_transfers_.push_back(if_transfer);
+        ++if_transfers_in_flight_;
         CHECK_LIBUSB_ERR(libusb_submit_transfer(if_transfer));
     }
 }
 
+void AGCMonitor::ReleaseIFTransfers() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_if_transfers_);
+        is_draining_if_transfers_ = true;
+    }
+    USRPTransfer(kOutVendorDeviceRequestINTransfer, 0);
+    for (auto if_transfer : if_transfers_) {
+        libusb_cancel_transfer(if_transfer);
+    }
+    // Nobody else handles the USB events anymore, the cancellations are
+    // reaped here.
+    auto deadline = std::chrono::steady_clock::now() +
+                    std::chrono::milliseconds(kDrainTimeout);
+    while (std::chrono::steady_clock::now() < deadline) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_if_transfers_);
+            if (if_transfers_in_flight_ == 0) {
+                break;
+            }
+        }
+        timeval tv = {0, kUSBHandleTimeout * 100};
+        libusb_handle_events_timeout_completed(nullptr /* context */, &tv,
+                                               nullptr /* completed */);
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_if_transfers_);
+    if (if_transfers_in_flight_ == 0) {
+        for (auto if_transfer : if_transfers_) {
+            delete[] if_transfer->buffer;
+            libusb_free_transfer(if_transfer);
+        }
+    } else {
+        // Still owned by libusb, better leaked than freed under it.
+        std::cerr << time(nullptr) << " [" << name_log_ << "]"
+                  << "IF transfers not drained, not freeing them."
+                  << std::endl;
+    }
+    if_transfers_.clear();
+    if_transfers_in_flight_ = 0;
+    is_draining_if_transfers_ = false;
+    // What came after the packing thread was done, so the next recording
+    // starts empty.
+    std::lock_guard<std::mutex> queue_lock(mutex_unpacked_if_queue_);
+    unpacked_IF_queue_ = std::queue<IFBuffer>();
+    while (semaphore_unpacked_if_queue_.try_wait()) {
+    }
+}
+
 void AGCMonitor::WriteAGCAndAGCTSToFileThread(void) {
+    Tracer::SetThreadName("WriteAGCAndAGCTSToFile");
     auto time = std::chrono::duration_cast<std::chrono::seconds>(
             std::chrono::system_clock::now().time_since_epoch()).count();
     std::ostringstream filename;
@@ -396,6 +609,7 @@ void AGCMonitor::WriteAGCAndAGCTSToFileThread(void) {
 }
 
 void AGCMonitor::WriteIFToFileThread(void) {
+    Tracer::SetThreadName("WriteIFToFile");
     auto time_v = std::chrono::duration_cast<std::chrono::seconds>(
             std::chrono::system_clock::now().time_since_epoch()).count();
     std::ostringstream filename;
@@ -403,38 +617,157 @@ void AGCMonitor::WriteIFToFileThread(void) {
     strftime(buf, sizeof(buf), "%Y-%m-%dT%H-%M-%S",
              gmtime(reinterpret_cast<time_t *>(&time_v)));
 
-    std::ofstream file;
-    file.open("/" + name_log_ + "_IF_" + buf + ".bin",
-              std::ios_base::out | std::ios_base::binary);
-    if (!file.is_open() || !file.good()) {
-        std::cerr << time(nullptr) << " Couldn't open file." << std::endl;
+    // The file always comes first, live consumers are served after it.
+    std::vector<std::unique_ptr<IFSink>> sinks;
+    // Lists the mode of the IF data from each offset on, next to the data.
+    std::string modes_path;
+    if (FLAGS_stripedirs.empty()) {
+        FileIFSink::Options options;
+        options.write_size = FLAGS_ifwritekb * 1024;
+        options.direct = FLAGS_ifdirect;
+        options.sync = FLAGS_ifsync == "range" ? FileIFSink::Sync::kRange
+                       : FLAGS_ifsync == "data" ? FileIFSink::Sync::kData
+                       : FileIFSink::Sync::kNone;
+        options.sync_size = std::max(FLAGS_ifsyncmb, 1u) << 20;
+        sinks.emplace_back(
+                new FileIFSink("/" + name_log_ + "_IF_" + buf + ".bin",
+                               circular_if_file_, kMaxCircularIFSize,
+                               options));
+        modes_path = "/" + name_log_ + "_IF_" + buf + ".modes";
     } else {
-        std::cerr << time(nullptr) << " Could open file." << std::endl;
+        std::vector<std::string> directories;
+        std::stringstream ss(FLAGS_stripedirs);
+        std::string directory;
+        while (std::getline(ss, directory, ',')) {
+            directories.push_back(directory);
+        }
+        // Only the last path component of the log name, the directories
+        // say where the files go.
+        std::string name = name_log_.substr(name_log_.rfind('/') + 1);
+        sinks.emplace_back(new StripedIFSink(
+                directories, name + "_IF_" + buf,
+                std::max(FLAGS_stripechunk, 1u) * 1024,
+                FLAGS_stripeplacement == "roundrobin"
+                ? StripedIFSink::Placement::kRoundRobin
+                : StripedIFSink::Placement::kLatency));
+        modes_path = directories[0] + "/" + name + "_IF_" + buf + ".modes";
+    }
+    if (!FLAGS_ifshm.empty()) {
+        // A slot holds one packed buffer, complex data packs the least.
+        sinks.emplace_back(
+                new SharedMemoryIFSink(FLAGS_ifshm, FLAGS_ifshmslots,
+                                       if_transfer_buffer_size_ / 2));
+    }
+    if (!FLAGS_ifsocket.empty()) {
+        // Messages of one packed transfer, fused batches get split.
+        sinks.emplace_back(new UnixSocketIFSink(FLAGS_ifsocket,
+                                                if_transfer_buffer_size_ / 2));
     }
 
-    while (!stop_request_ || !packed_IF_queue_.empty()) {
+    std::ofstream modes_file(modes_path);
+    if (!modes_file.is_open()) {
+        ERROR_EXIT("Couldn't open IF modes file.");
+    }
+    modes_file << "# VISTA IF modes v1" << std::endl;
+    const SiGeMode *written_mode = nullptr;
+    uint64_t written_bytes = 0;
+    uint64_t dropped_bytes = 0;
+
+    while (true) {
         semaphore_packed_if_queue_.wait();
-        if (stop_request_ && packed_IF_queue_.empty()) {
-            break;
+        // The next packed IF data, from the packing thread's queue or from
+        // the fused ring.
+        IFBuffer if_buffer;
+        const SiGeMode *if_mode;
+        const uint8_t *if_data;
+        size_t if_size;
+        uint64_t dropped = 0;
+        if (is_fused_) {
+            std::lock_guard<std::mutex> lock(mutex_fused_ring_);
+            if (fused_published_ == 0) {
+                if (stop_request_) {
+                    break;
+                }
+                continue;
+            }
+            // The callbacks don't touch published batches.
+            const FusedBatch &batch = fused_ring_[
+                    (fused_filling_ + fused_ring_.size() - fused_published_) %
+                    fused_ring_.size()];
+            if_mode = batch.mode;
+            if_data = batch.data.data();
+            if_size = batch.size;
+            dropped = batch.dropped;
+        } else {
+            if (stop_request_ && packed_IF_queue_.empty()) {
+                break;
+            }
+            mutex_packed_if_queue_.lock();
+            if_buffer = std::move(packed_IF_queue_.front());
+            packed_IF_queue_.pop();
+            TRACE_EVENT(TraceEvent::kPackedQueuePop, packed_IF_queue_.size());
+            mutex_packed_if_queue_.unlock();
+            if_mode = if_buffer.mode;
+            if_data = if_buffer.data.data();
+            if_size = if_buffer.data.size();
         }
-        mutex_packed_if_queue_.lock();
-        auto if_data = packed_IF_queue_.front();
-        packed_IF_queue_.pop();
-        mutex_packed_if_queue_.unlock();
 
-        file.write(reinterpret_cast<char *>(if_data.data()), if_data.size());
-        if (circular_if_file_ && file.tellp() > kMaxCircularIFSize) {
-            std::cerr << time(nullptr) << " A new circle. Last tellp location: "
-                      << file.tellp() << std::endl;
-            file.seekp(0);
+        if (dropped > 0) {
+            modes_file << "gap " << written_bytes << " " << dropped << " "
+                       << time(nullptr) << std::endl;
+            std::cerr << time(nullptr) << ": [" << name_log_ << "]"
+                      << "The writer fell behind, " << dropped
+                      << " bytes of packed IF data dropped." << std::endl;
+            dropped_bytes += dropped;
+        }
+        // A batch may carry nothing but the drops before it.
+        if (if_size == 0) {
+            std::lock_guard<std::mutex> lock(mutex_fused_ring_);
+            --fused_published_;
+            continue;
+        }
+        // Offsets count every byte written, also past a circular file's wrap.
+        if (if_mode != written_mode) {
+            written_mode = if_mode;
+            modes_file << "mode " << written_bytes << " "
+                       << static_cast<int>(written_mode->devmode) << " "
+                       << time(nullptr) << std::endl;
+        }
+        written_bytes += if_size;
+
+        TRACE_EVENT(TraceEvent::kWriteBegin, if_size);
+        for (auto &sink : sinks) {
+            sink->Write(if_data, if_size);
+        }
+        TRACE_EVENT(TraceEvent::kWriteEnd, if_size);
+
+        if (is_fused_) {
+            std::lock_guard<std::mutex> lock(mutex_fused_ring_);
+            --fused_published_;
+            TRACE_EVENT(TraceEvent::kPackedQueuePop, fused_published_);
+        }
+    }
+    if (is_fused_) {
+        // Drops after the last batch that could be published.
+        std::lock_guard<std::mutex> lock(mutex_fused_ring_);
+        const uint64_t dropped = fused_ring_[fused_filling_].dropped;
+        if (dropped > 0) {
+            modes_file << "gap " << written_bytes << " " << dropped << " "
+                       << time(nullptr) << std::endl;
+            dropped_bytes += dropped;
         }
-        file.flush();
     }
-    std::cerr << time(nullptr) << " Stopping write. Tellp location: "
-              << file.tellp() << std::endl;
+    if (dropped_bytes > 0) {
+        std::cerr << time(nullptr) << ": [" << name_log_ << "]"
+                  << dropped_bytes << " bytes of packed IF data dropped in "
+                  << "all, the writer fell behind." << std::endl;
+    }
+    // Where the data ends tells where a circular file wrapped.
+    modes_file << "end " << written_bytes << " " << time(nullptr) << std::endl;
 }
 
 void AGCMonitor::AGCAndOverrunThread() {
+    Tracer::SetThreadName("AGCAndOverrun");
     bool b_err = false;
 
     // Check if the device is already overrun -- can't continue if so.
@@ -444,6 +777,7 @@ void AGCMonitor::AGCAndOverrunThread() {
     }
 
     while (!stop_request_) {
+        TRACE_EVENT(TraceEvent::kAGCPollBegin, 0);
         // Get AGC.
         std::vector<uint16_t> raw_agc_data(kAGCTransferBufferSize);
         uint64_t read_count = ReadAGC(raw_agc_data.size(), raw_agc_data.data());
@@ -462,14 +796,90 @@ void AGCMonitor::AGCAndOverrunThread() {
 
         // Get overrun status.
         GetStatus(GS_kControlTransferIndexIsRXOverrun, &b_err);
+        TRACE_EVENT(TraceEvent::kAGCPollEnd, read_count);
         if (b_err) {
             ERROR_EXIT("Overrun detected. Quitting.");
         }
+
+        unsigned char requested_mode = 0;
+        {
+            std::lock_guard<std::mutex> lock(mutex_requested_modes_);
+            if (!requested_modes_.empty()) {
+                requested_mode = requested_modes_.front();
+                requested_modes_.pop();
+            }
+        }
+        if (requested_mode != 0 &&
+            requested_mode != mode_.load()->devmode) {
+            ChangeMode(*FindSiGeMode(requested_mode));
+        }
         std::this_thread::sleep_for(std::chrono::milliseconds(kAGCReadTimeout));
     }
 }
 
+void AGCMonitor::ConfigureFrontend(const SiGeMode &mode) {
+    unsigned char uc_flags[5];
+    USRPTransfer(kOutVendorDeviceRequestINTransfer, 0);
+    USRPTransfer(kOutVendorDeviceRequestCMode, mode.fw_mode);
+    USRPTransfer(kOutVendorDeviceRequestINTransfer, 1);
+    USRPTransfer(kOutVendorDeviceRequestAGC, 2);
+
+    USRPTransfer(kOutVendorDeviceRequestAGC, 1);
+    USRPTransfer(kOutVendorDeviceRequestAGC, 2);
+    USRPTransfer2(kInVendorDeviceRequestFlags, 0, 5, uc_flags);
+    USRPTransfer(kOutVendorDeviceRequestAGC, 2);
+}
+
+void AGCMonitor::ChangeMode(const SiGeMode &mode) {
+    TRACE_EVENT(TraceEvent::kModeChangeBegin, mode.devmode);
+    {
+        std::lock_guard<std::mutex> lock(mutex_if_transfers_);
+        is_draining_if_transfers_ = true;
+    }
+    // Stop the stream, then get back the transfers it left waiting. Those
+    // that completed meanwhile are not found, their callbacks drain them.
+    USRPTransfer(kOutVendorDeviceRequestINTransfer, 0);
+    for (auto if_transfer : if_transfers_) {
+        libusb_cancel_transfer(if_transfer);
+    }
+    {
+        std::unique_lock<std::mutex> lock(mutex_if_transfers_);
+        if (!condition_if_transfers_drained_.wait_for(
+                lock, std::chrono::milliseconds(kDrainTimeout),
+                [this] {
+                    return if_transfers_in_flight_ == 0 || stop_request_;
+                })) {
+            ERROR_EXIT("IF transfers not drained for the mode change.");
+            return;
+        }
+        if (stop_request_) {
+            // USB events may no longer be handled, so the drain may never
+            // end. ReleaseIFTransfers takes over.
+            std::cerr << time(nullptr) << ": [" << name_log_ << "]"
+                      << "Mode change given up, recording stops."
+                      << std::endl;
+            return;
+        }
+        is_draining_if_transfers_ = false;
+        if_transfers_in_flight_ = if_transfers_.size();
+    }
+
+    // Nothing is in flight, buffers from here on are in the new mode. The
+    // frontend gets the same setup as at the start of the recording.
+    mode_ = &mode;
+    for (auto if_transfer : if_transfers_) {
+        CHECK_LIBUSB_ERR(libusb_submit_transfer(if_transfer));
+    }
+    ConfigureFrontend(mode);
+    TRACE_EVENT(TraceEvent::kModeChangeEnd, mode.devmode);
+
+    std::cerr << time(nullptr) << ": [" << name_log_ << "]"
+              << "Changed to devmode " << static_cast<int>(mode.devmode)
+              << "." << std::endl;
+}
+
 void AGCMonitor::AsyncUSBThread() {
+    Tracer::SetThreadName("AsyncUSB");
     // Constant is in ms, timeval has us, so multiply by 1000.
     timeval tv = {0, kUSBHandleTimeout * 1000};
     while (!stop_request_) {
@@ -478,49 +888,138 @@ void AGCMonitor::AsyncUSBThread() {
     }
 }
 
+void AGCMonitor::WatchUSBEvents() {
+    libusb_set_pollfd_notifiers(nullptr /* context */, USBPollfdAdded,
+                                USBPollfdRemoved, reactor_);
+    const libusb_pollfd **pollfds = libusb_get_pollfds(nullptr /* context */);
+    if (pollfds == nullptr) {
+        ERROR_EXIT("Couldn't get the USB file descriptors.");
+        return;
+    }
+    for (const libusb_pollfd **pollfd = pollfds; *pollfd != nullptr; ++pollfd) {
+        USBPollfdAdded((*pollfd)->fd, (*pollfd)->events, reactor_);
+    }
+    libusb_free_pollfds(pollfds);
+
+    // Old kernels have no timerfd, libusb timeouts then need a timer here.
+    if (!libusb_pollfds_handle_timeouts(nullptr /* context */)) {
+        usb_timeout_timer_ = reactor_->AddTimer(
+                kUSBHandleTimeout / 1000.0, true /* periodic */,
+                [] { HandleUSBEvents(0); });
+    }
+}
+
+void AGCMonitor::UnwatchUSBEvents() {
+    libusb_set_pollfd_notifiers(nullptr /* context */, nullptr, nullptr,
+                                nullptr);
+    const libusb_pollfd **pollfds = libusb_get_pollfds(nullptr /* context */);
+    if (pollfds != nullptr) {
+        for (const libusb_pollfd **pollfd = pollfds; *pollfd != nullptr;
+             ++pollfd) {
+            reactor_->Unwatch((*pollfd)->fd);
+        }
+        libusb_free_pollfds(pollfds);
+    }
+    if (usb_timeout_timer_ >= 0) {
+        reactor_->CancelTimer(usb_timeout_timer_);
+        usb_timeout_timer_ = -1;
+    }
+}
+
 void AGCMonitor::IFPackingThread() {
+    Tracer::SetThreadName("IFPacking");
     while (!stop_request_) {
         semaphore_unpacked_if_queue_.wait();
         if (stop_request_) {
             break;
         }
         mutex_unpacked_if_queue_.lock();
-        auto unpacked_if = unpacked_IF_queue_.front();
+        auto unpacked_buffer = std::move(unpacked_IF_queue_.front());
         unpacked_IF_queue_.pop();
+        TRACE_EVENT(TraceEvent::kUnpackedQueuePop, unpacked_IF_queue_.size());
         mutex_unpacked_if_queue_.unlock();
-
-        // Packs 1x4 samples in 1 byte (for real data)
-        std::vector<uint8_t> packed_if(kIFTransferBufferSize / pack_mode_);
-        if (pack_mode_ == 4 && !is_complex_data_) {
-            for (unsigned offset = 0, buffer_index = 0;
-                 offset < kIFTransferBufferSize; offset += 4, ++buffer_index) {
-                packed_if[buffer_index] = (unpacked_if[offset] & k2BitMask) |
-                                          ((unpacked_if[offset + 1] & k2BitMask)
-                                                  << 2) |
-                                          ((unpacked_if[offset + 2] & k2BitMask)
-                                                  << 4) |
-                                          ((unpacked_if[offset + 3] & k2BitMask)
-                                                  << 6);
-            }
-            // Packs 2x2 samples in 1 byte (for complex data)
-        } else if (pack_mode_ == 2 && is_complex_data_) {
-            for (unsigned offset = 0, buffer_index = 0;
-                 offset < kIFTransferBufferSize; offset += 2, ++buffer_index) {
-                packed_if[buffer_index] = (unpacked_if[offset] & k4BitMask) |
-                                          ((unpacked_if[offset + 1] & k4BitMask)
-                                                  << 4);
-            }
-        } else {
+        const auto &unpacked_if = unpacked_buffer.data;
+        const unsigned char pack_mode = unpacked_buffer.mode->pack_mode;
+        const bool is_complex_data = unpacked_buffer.mode->is_complex;
+
+        quick_look_.Offer(unpacked_if.data(), unpacked_if.size(),
+                          is_complex_data);
+
+        TRACE_EVENT(TraceEvent::kPackBegin, unpacked_if.size());
+        IFBuffer packed_buffer = {unpacked_buffer.mode,
+                                  std::vector<uint8_t>(unpacked_if.size() /
+                                                       pack_mode)};
+        auto &packed_if = packed_buffer.data;
+        if (PackIF(unpacked_if.data(), unpacked_if.size(),
+                   *unpacked_buffer.mode, packed_if.data()) == 0) {
             ERROR_EXIT("Uncompatible settings for packmode and complex data");
         }
 
+        TRACE_EVENT(TraceEvent::kPackEnd, packed_if.size());
+
         mutex_packed_if_queue_.lock();
-        packed_IF_queue_.push(packed_if);
+        packed_IF_queue_.push(std::move(packed_buffer));
+        TRACE_EVENT(TraceEvent::kPackedQueuePush, packed_IF_queue_.size());
         mutex_packed_if_queue_.unlock();
         semaphore_packed_if_queue_.notify();
     }
 }
 
+void AGCMonitor::PackIntoFusedRing(const uint8_t *buffer, const size_t size) {
+    const SiGeMode *mode = mode_;
+    quick_look_.Offer(buffer, size, mode->is_complex);
+
+    std::lock_guard<std::mutex> lock(mutex_fused_ring_);
+    if (stop_request_ || is_fused_ring_full_) {
+        return;
+    }
+    const size_t packed_size = size / mode->pack_mode;
+    FusedBatch *batch = &fused_ring_[fused_filling_];
+    // A batch holds whole buffers of one mode.
+    if (batch->size > 0 && (batch->mode != mode ||
+                            batch->size + packed_size > batch->data.size())) {
+        PublishFusedBatch();
+        if (is_fused_ring_full_) {
+            return;
+        }
+        batch = &fused_ring_[fused_filling_];
+    }
+    batch->mode = mode;
+    TRACE_EVENT(TraceEvent::kPackBegin, size);
+    if (PackIF(buffer, size, *mode, batch->data.data() + batch->size) == 0) {
+        ERROR_EXIT("Uncompatible settings for packmode and complex data");
+        return;
+    }
+    batch->size += packed_size;
+    TRACE_EVENT(TraceEvent::kPackEnd, packed_size);
+}
+
+void AGCMonitor::PublishFusedBatch() {
+    // The batch after this one must be free to be filled.
+    if (fused_published_ + 1 >= fused_ring_.size()) {
+        if (!FLAGS_fusedfatal) {
+            // The batch is dropped and filled again, the writer is told how
+            // much is missing before the next one it gets.
+            FusedBatch &batch = fused_ring_[fused_filling_];
+            batch.dropped += batch.size;
+            batch.size = 0;
+            return;
+        }
+        // Once: the callbacks stop packing, the batch stays unpublished.
+        if (!is_fused_ring_full_) {
+            is_fused_ring_full_ = true;
+            ERROR_EXIT("Fused IF ring full, the writer fell behind. Quitting.");
+        }
+        return;
+    }
+    ++fused_published_;
+    fused_filling_ = (fused_filling_ + 1) % fused_ring_.size();
+    fused_ring_[fused_filling_].size = 0;
+    fused_ring_[fused_filling_].dropped = 0;
+    TRACE_EVENT(TraceEvent::kPackedQueuePush, fused_published_);
+    semaphore_packed_if_queue_.notify();
+}
+
 uint64_t AGCMonitor::ReadAGC(const uint64_t buf_size, uint16_t *buf) {
     unsigned char *cp_agc_data = new unsigned char[buf_size * 2];
     unsigned char uc_flags[5];
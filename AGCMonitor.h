@@ -1,11 +1,18 @@
 #pragma once
 
+#include "QuickLookMonitor.h"
 #include "Semaphore.h"
 
+#include <atomic>
+#include <condition_variable>
 #include <libusb-1.0/libusb.h>
 #include <queue>
 #include <thread>
 
+class Reactor;
+
+struct SiGeMode;
+
 // The AGCMonitor, once constructed, configured and started will have four
 // threads working.
 //
@@ -21,11 +28,20 @@
 //
 // AGCAndOverrunThread periodically collects the AGC data (gain strength) from
 // the SiGe module and checks if the USB buffer on the SiGe module was overran.
+// It also carries out mode changes requested while recording: the IF
+// transfers are drained, the frontend is set to the new mode and the
+// transfers are resubmitted. IF buffers carry the mode they were sampled in,
+// so packing follows, and the writer records every change.
 // It uses synchronous/blocking USB transfers when getting the required info,
 // because low throughput is needed. The AGC data is stored in the AGC circular
 // buffer which is ready to be written to a file on a saving request.
+// It stays a sleeping thread rather than a Reactor timer: a poll blocks in
+// several control transfers, and a mode change waits for the IF transfers to
+// drain, which takes the Reactor's thread handling their USB events.
 //
-// AsyncUSBThread handles asynchronous USB transfers (a lot of IF data).
+// AsyncUSBThread handles asynchronous USB transfers (a lot of IF data). With a
+// Reactor (see SetReactor), the Reactor's thread handles them instead, woken
+// by libusb's file descriptors.
 // Asynchronous USB transfers are used because there is a lot of data
 // that needs to be transferred, so doing it synchronously/blocking would be
 // too slow and the SiGe module would have its buffers overran. The actual
@@ -36,9 +52,15 @@
 // IFPackingThread processes IF data from a a queue that the AsyncUSBThread has put it
 // in. Processing includes packing a few samples into a byte (because each
 // sample is two bits) and putting it in the IF circular buffer which is ready
-// to be written to a file on a saving request.
+// to be written to a file on a saving request. It also offers the unpacked
+// data to the QuickLookMonitor, which runs its own SCHED_IDLE thread.
 //
 //
+// With --fused, IFPackingThread isn't started: the transfer callback packs
+// the IF data itself, straight into a ring of preallocated batches, and
+// WriteIFToFileThread only wakes up once per batch. On a single core this
+// saves two thread switches and two queue hops per transfer.
+//
 // All the threads use blocking mechanisms such as semaphores, mutexes or timers
 // to achieve thread safety and relatively low CPU usage. So many threads exist
 // primarily because low latency is needed when handling the completed USB
@@ -60,10 +82,36 @@ public:
     // provided buffer into the IF queue, for further processing.
     void PushIFBufferIntoQueue(const uint8_t *buffer, const size_t size);
 
+    // Also used by the USB transfer callback. While a mode change drains the
+    // IF transfers, they are not resubmitted and each one must be reported
+    // drained instead.
+    bool IsDrainingIFTransfers();
+
+    void IFTransferDrained();
+
+    // Resubmits a completed IF transfer, or reports it drained if a mode
+    // change started meanwhile.
+    int ResubmitIFTransfer(libusb_transfer *transfer);
+
     void SetMode(const unsigned char mode);
 
+    // Switches to another mode while recording, as soon as
+    // AGCAndOverrunThread gets to it, one request per poll in the order they
+    // came. Can be called from any thread.
+    void RequestModeChange(const unsigned char mode);
+
+    // Number of IF transfers kept queued and the size of each of their
+    // buffers. The size must be a multiple of 512 (USB packet) and of 4
+    // (packing). Must be set before OpenDevice.
+    void SetTransfers(const unsigned count, const unsigned buffer_size);
+
     void SetLogName(const std::string &nm);
 
+    // Has the reactor's thread handle the USB events rather than
+    // AsyncUSBThread. Must be set before StartRecording, and the reactor must
+    // be running while recording.
+    void SetReactor(Reactor *reactor);
+
     void OpenDevice();
 
     void CloseDevice();
@@ -81,6 +129,10 @@ private:
     // there is a lot of GPS data.
     void AllocateAndSubmitIFTransfers();
 
+    // Cancels the IF transfers and frees them with their buffers, once the
+    // USB events are no longer handled elsewhere.
+    void ReleaseIFTransfers();
+
     void WriteAGCAndAGCTSToFileThread();
 
     void WriteIFToFileThread();
@@ -89,8 +141,27 @@ private:
 
     void AsyncUSBThread();
 
+    // Registers libusb's file descriptors with reactor_, and unregisters them.
+    void WatchUSBEvents();
+
+    void UnwatchUSBEvents();
+
     void IFPackingThread();
 
+    // Sets the frontend to mode and starts it streaming, with the AGC
+    // re-armed for it.
+    void ConfigureFrontend(const SiGeMode &mode);
+
+    // Drains the IF transfers and restarts the frontend in the new mode.
+    void ChangeMode(const SiGeMode &mode);
+
+    // Fused mode: packs a transfer's buffer into the batch being filled.
+    void PackIntoFusedRing(const uint8_t *buffer, const size_t size);
+
+    // Hands the batch being filled to the writer, unless the ring is full.
+    // Must be called with mutex_fused_ring_ held.
+    void PublishFusedBatch();
+
     uint64_t ReadAGC(const uint64_t buf_size, uint16_t *buf);
 
     // Next four are basic functions to dialog with the SiGe's firmware.
@@ -118,16 +189,50 @@ private:
     Semaphore semaphore_unpacked_if_queue_;
     std::queue<std::vector<uint16_t>> AGC_queue_;
     std::queue<std::vector<int64_t>> AGCTS_queue_;
-    std::queue<std::vector<uint8_t>> packed_IF_queue_;
-    std::queue<std::vector<uint8_t>> unpacked_IF_queue_;
+    // IF data and the mode it was sampled in.
+    struct IFBuffer {
+        const SiGeMode *mode;
+        std::vector<uint8_t> data;
+    };
+    // A batch of packed IF data in the fused ring.
+    struct FusedBatch {
+        const SiGeMode *mode;
+        std::vector<uint8_t> data;
+        size_t size;
+        // Packed bytes dropped before this batch, the ring being full.
+        uint64_t dropped;
+    };
+    std::queue<IFBuffer> packed_IF_queue_;
+    std::queue<IFBuffer> unpacked_IF_queue_;
     std::thread thread_agc_and_overrun_;
     std::thread thread_write_agc_to_file_;
     std::thread thread_write_if_to_file_;
     std::thread thread_async_usb_;
     std::thread thread_if_packing_;
+    QuickLookMonitor quick_look_;
+    Reactor *reactor_;
+    // Reactor timer handling libusb's timeouts, if its fds don't; -1 if none.
+    int usb_timeout_timer_;
 
     std::string name_log_;
-    unsigned char fw_mode_;
-    unsigned char pack_mode_;
-    bool is_complex_data_;
+    std::atomic<const SiGeMode *> mode_;
+    std::mutex mutex_requested_modes_;
+    std::queue<unsigned char> requested_modes_;
+    unsigned number_of_transfers_;
+    unsigned if_transfer_buffer_size_;
+    std::vector<libusb_transfer *> if_transfers_;
+    std::mutex mutex_if_transfers_;
+    std::condition_variable condition_if_transfers_drained_;
+    std::atomic<bool> is_draining_if_transfers_;
+    size_t if_transfers_in_flight_;
+    bool is_fused_;
+    std::mutex mutex_fused_ring_;
+    std::vector<FusedBatch> fused_ring_;
+    // Batch being filled, and number of batches before it that were handed
+    // to the writer and aren't written yet.
+    size_t fused_filling_;
+    size_t fused_published_;
+    // With --fusedfatal, set once the writer fell behind, the callbacks then
+    // drop everything.
+    bool is_fused_ring_full_;
 };
@@ -0,0 +1,608 @@
+// SiGeConvert turns packed IF recordings (<logname>_IF_<time>.bin, or the
+// .manifest or stripe files of a striped recording) into SigMF recordings: a .sigmf-data file
+// of int8 or int16 samples, interleaved I/Q for complex modes, and a
+// .sigmf-meta file with the devmode's sample rate and IF frequency. A
+// recording whose mode changed live is split into one SigMF recording per
+// mode, following its .modes file.
+//
+// The input is cut into chunks that worker threads unpack independently, each
+// straight to its place in the output file, so the conversion runs as fast as
+// the disks allow. Samples are mapped with --lookuptable, like the recorder.
+
+#include "IFSink.h"
+#include "LookupTable.h"
+#include "SiGeModes.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <gflags/gflags.h>
+#include <iostream>
+#include <sstream>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+static bool ValidateDevMode(const char *flagname, int32_t devmode) {
+    if (FindSiGeMode(static_cast<unsigned>(devmode)) != nullptr) {
+        return true;
+    }
+    std::cerr << "Invalid value for --" << flagname << ": " << devmode
+              << std::endl;
+    return false;
+}
+
+DEFINE_int32(devmode, 8,
+             "Mode the recording was made with, if it has no .modes file.");
+DEFINE_validator(devmode, ValidateDevMode);
+
+static bool ValidateFormat(const char *flagname, const std::string &format) {
+    if (format == "int8" || format == "int16") {
+        return true;
+    }
+    std::cerr << "--" << flagname << " must be int8 or int16." << std::endl;
+    return false;
+}
+
+DEFINE_string(format, "int8", "Output sample format: int8 or int16.");
+DEFINE_validator(format, ValidateFormat);
+DEFINE_string(output, "",
+              "Output path without extension, defaults to the input's.");
+DEFINE_uint32(threads, 0, "Worker threads, 0 for one per core.");
+DEFINE_uint32(chunkmb, 16, "Size in MB of the input chunks given to workers.");
+
+namespace {
+    constexpr double kL1Frequency = 1575.42e6;
+    // Packed bytes a worker unpacks at a time.
+    constexpr size_t kBlockSize = 1 << 20;
+
+    // A piece of the packed stream: length bytes at offset in fd, which are
+    // bytes logical_offset onwards of the recording.
+    struct Segment {
+        int fd;
+        uint64_t offset;
+        uint64_t length;
+        uint64_t logical_offset;
+    };
+
+    bool EndsWith(const std::string &text, const std::string &suffix) {
+        return text.size() >= suffix.size() &&
+               text.compare(text.size() - suffix.size(), suffix.size(),
+                            suffix) == 0;
+    }
+
+    int OpenInput(const std::string &path) {
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            std::cerr << "Couldn't open " << path << ": " << strerror(errno)
+                      << std::endl;
+            exit(1);
+        }
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        return fd;
+    }
+
+    // The recording a file belongs to, without extension: a stripe file
+    // <name>.s<N>.bin belongs to <name>.
+    std::string RecordingBase(const std::string &path) {
+        std::string base = path.substr(0, path.rfind('.'));
+        const size_t dot = base.rfind('.');
+        if (EndsWith(path, ".bin") && dot != std::string::npos &&
+            dot + 2 <= base.size() && base[dot + 1] == 's' &&
+            base.find_first_not_of("0123456789", dot + 2) ==
+                    std::string::npos) {
+            base.resize(dot);
+        }
+        return base;
+    }
+
+    // Adds a segment per chunk of a stripe file, found from the header in
+    // front of each. A chunk cut short by a failed write is kept as far as it
+    // goes.
+    void ScanStripe(const std::string &path,
+                    std::vector<Segment> *segments) {
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            std::cerr << "Couldn't open stripe " << path << ": "
+                      << strerror(errno) << ", its chunks are lost."
+                      << std::endl;
+            return;
+        }
+        struct stat st;
+        fstat(fd, &st);
+        const uint64_t size = static_cast<uint64_t>(st.st_size);
+        uint64_t position = 0;
+        while (position + sizeof(StripeChunkHeader) <= size) {
+            StripeChunkHeader header;
+            if (pread(fd, &header, sizeof(header), position) !=
+                        static_cast<ssize_t>(sizeof(header)) ||
+                header.magic != StripeChunkHeader::kMagic) {
+                std::cerr << "Bad chunk header in " << path << " at "
+                          << position << ", ignoring the rest of it."
+                          << std::endl;
+                break;
+            }
+            position += sizeof(header);
+            uint64_t length = std::min<uint64_t>(header.length,
+                                                 size - position);
+            if (length < header.length) {
+                std::cerr << "Chunk " << header.sequence << " in " << path
+                          << " is cut short." << std::endl;
+            }
+            segments->push_back({fd, position, length, header.stream_offset});
+            position += length;
+        }
+    }
+
+    // Reads a striped recording's manifest. One in the first format lists
+    // every chunk, in the current one the stripe files describe their chunks.
+    void ReadManifest(const std::string &path,
+                      std::vector<Segment> *segments) {
+        std::ifstream manifest(path);
+        if (!manifest.is_open()) {
+            std::cerr << "Couldn't open " << path << "." << std::endl;
+            exit(1);
+        }
+        std::vector<std::string> target_paths;
+        std::vector<std::pair<uint64_t, Segment>> chunks;
+        uint64_t chunk_size = 0;
+        std::string line;
+        while (std::getline(manifest, line)) {
+            std::istringstream ss(line);
+            std::string kind;
+            ss >> kind;
+            if (kind == "chunk_size") {
+                ss >> chunk_size;
+            } else if (kind == "target") {
+                size_t index;
+                std::string target_path;
+                ss >> index >> target_path;
+                target_paths.resize(std::max(target_paths.size(), index + 1));
+                target_paths[index] = target_path;
+            } else if (kind == "chunk") {
+                uint64_t sequence;
+                size_t target;
+                Segment segment;
+                ss >> sequence >> target >> segment.offset >> segment.length;
+                if (!ss || target >= target_paths.size()) {
+                    std::cerr << "Bad manifest line: " << line << std::endl;
+                    exit(1);
+                }
+                segment.fd = static_cast<int>(target);  // Opened below.
+                chunks.emplace_back(sequence, segment);
+            }
+        }
+        if (chunks.empty()) {
+            for (const auto &target_path : target_paths) {
+                ScanStripe(target_path, segments);
+            }
+            return;
+        }
+        std::vector<int> targets;
+        for (const auto &target_path : target_paths) {
+            targets.push_back(OpenInput(target_path));
+        }
+        for (auto &chunk : chunks) {
+            chunk.second.fd = targets[chunk.second.fd];
+        }
+        std::sort(chunks.begin(), chunks.end(),
+                  [](const std::pair<uint64_t, Segment> &a,
+                     const std::pair<uint64_t, Segment> &b) {
+                      return a.first < b.first;
+                  });
+        if (chunk_size == 0) {
+            // Every chunk but the last is full.
+            for (const auto &chunk : chunks) {
+                chunk_size = std::max(chunk_size, chunk.second.length);
+            }
+        }
+        // Chunks stay at their place in the stream, a missing one leaves a
+        // gap that the output keeps zero-filled.
+        for (const auto &chunk : chunks) {
+            Segment segment = chunk.second;
+            segment.logical_offset = chunk.first * chunk_size;
+            segments->push_back(segment);
+        }
+    }
+
+    // A plain recording is one segment; a striped one has a segment per
+    // chunk, found in its stripe files, which are either given directly or
+    // listed by its manifest. Manifests of the first format list every chunk
+    // instead.
+    std::vector<Segment> ReadSegments(const std::vector<std::string> &inputs) {
+        std::vector<Segment> segments;
+        const std::string &path = inputs.front();
+        if (inputs.size() > 1 ||
+            RecordingBase(path) != path.substr(0, path.rfind('.'))) {
+            for (const auto &input : inputs) {
+                ScanStripe(input, &segments);
+            }
+        } else if (!EndsWith(path, ".manifest")) {
+            int fd = OpenInput(path);
+            struct stat st;
+            fstat(fd, &st);
+            segments.push_back({fd, 0, static_cast<uint64_t>(st.st_size), 0});
+            return segments;
+        } else {
+            ReadManifest(path, &segments);
+        }
+        std::sort(segments.begin(), segments.end(),
+                  [](const Segment &a, const Segment &b) {
+                      return a.logical_offset < b.logical_offset;
+                  });
+        return segments;
+    }
+
+    // Parts of the stream that no segment covers, as [start, end) pairs.
+    std::vector<std::pair<uint64_t, uint64_t>> FindGaps(
+            const std::vector<Segment> &segments) {
+        std::vector<std::pair<uint64_t, uint64_t>> gaps;
+        uint64_t covered = 0;
+        for (const auto &segment : segments) {
+            if (segment.logical_offset > covered) {
+                gaps.emplace_back(covered, segment.logical_offset);
+            }
+            covered = std::max(covered,
+                               segment.logical_offset + segment.length);
+        }
+        return gaps;
+    }
+
+    // Output bytes of every possible packed byte.
+    std::vector<uint8_t> BuildTable(const SiGeMode &mode, size_t value_size,
+                                    size_t *expansion) {
+        const auto lut = GetLookupTable();
+        const unsigned values = mode.is_complex ? 2 * mode.pack_mode
+                                                : mode.pack_mode;
+        *expansion = values * value_size;
+        std::vector<uint8_t> table(256 * *expansion);
+        for (unsigned byte = 0; byte < 256; ++byte) {
+            uint8_t *out = &table[byte * *expansion];
+            for (unsigned v = 0; v < values; ++v) {
+                // Real: one 2-bit sample per value. Complex: each sample is a
+                // nibble, I in its low two bits and Q in the high two.
+                const unsigned code = (byte >> (2 * v)) & 0x03;
+                const int16_t level = lut[code];
+                if (value_size == 1) {
+                    out[v] = static_cast<uint8_t>(static_cast<int8_t>(level));
+                } else {
+                    memcpy(out + 2 * v, &level, 2);  // Little endian hosts.
+                }
+            }
+        }
+        return table;
+    }
+
+    bool PWriteAll(int fd, const uint8_t *data, size_t size, uint64_t offset) {
+        while (size > 0) {
+            ssize_t written = pwrite(fd, data, size, static_cast<off_t>(offset));
+            if (written < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return false;
+            }
+            data += written;
+            size -= static_cast<size_t>(written);
+            offset += static_cast<uint64_t>(written);
+        }
+        return true;
+    }
+
+    bool PReadAll(int fd, uint8_t *data, size_t size, uint64_t offset) {
+        while (size > 0) {
+            ssize_t got = pread(fd, data, size, static_cast<off_t>(offset));
+            if (got <= 0) {
+                if (got < 0 && errno == EINTR) {
+                    continue;
+                }
+                return false;
+            }
+            data += got;
+            size -= static_cast<size_t>(got);
+            offset += static_cast<uint64_t>(got);
+        }
+        return true;
+    }
+
+    // gaps are in samples from the start of the recording.
+    void WriteMetadata(const std::string &path, const SiGeMode &mode,
+                       const std::string &datatype,
+                       const std::vector<std::pair<uint64_t, uint64_t>> &gaps) {
+        std::ofstream meta(path);
+        meta.precision(12);
+        meta << "{\n"
+             << "    \"global\": {\n"
+             << "        \"core:datatype\": \"" << datatype << "\",\n"
+             << "        \"core:sample_rate\": " << mode.sample_rate << ",\n"
+             << "        \"core:version\": \"1.0.0\",\n"
+             << "        \"core:description\": \"VISTA SiGe GPS L1 IF recording, devmode "
+             << static_cast<int>(mode.devmode) << "\",\n"
+             << "        \"core:recorder\": \"SiGeDumperLite\",\n"
+             << "        \"vista:devmode\": "
+             << static_cast<int>(mode.devmode) << ",\n"
+             << "        \"vista:if_frequency\": " << mode.if_frequency
+             << ",\n"
+             << "        \"vista:lookup_table\": \"" << FLAGS_lookuptable
+             << "\"\n"
+             << "    },\n"
+             << "    \"captures\": [\n"
+             << "        {\n"
+             << "            \"core:sample_start\": 0,\n"
+             << "            \"core:frequency\": " << mode.if_frequency
+             << ",\n"
+             << "            \"vista:rf_frequency\": " << kL1Frequency
+             << "\n"
+             << "        }\n"
+             << "    ],\n"
+             << "    \"annotations\": [";
+        for (size_t i = 0; i < gaps.size(); ++i) {
+            meta << (i == 0 ? "\n" : ",\n")
+                 << "        {\n"
+                 << "            \"core:sample_start\": " << gaps[i].first
+                 << ",\n"
+                 << "            \"core:sample_count\": "
+                 << gaps[i].second - gaps[i].first << ",\n"
+                 << "            \"core:comment\": \"Missing from the recording, zero-filled.\"\n"
+                 << "        }";
+        }
+        meta << (gaps.empty() ? "]\n" : "\n    ]\n") << "}\n";
+        if (!meta.good()) {
+            std::cerr << "Couldn't write " << path << "." << std::endl;
+            exit(1);
+        }
+    }
+
+    // A part of the recording made in one mode.
+    struct Span {
+        uint64_t start;
+        uint64_t end;
+        const SiGeMode *mode;
+    };
+
+    // The recorder lists the mode of every part of the recording in a
+    // .modes file next to it. Recordings without one are all in --devmode.
+    // Its offsets count every byte written; in a circular file that wrapped,
+    // the last total bytes written survive, at their offset modulo total.
+    // Spans are in file offsets, from the oldest data to the newest.
+    std::vector<Span> ReadSpans(const std::string &base, uint64_t total) {
+        std::vector<std::pair<uint64_t, const SiGeMode *>> changes;
+        uint64_t end = 0;
+        bool has_end = false;
+        std::ifstream modes(base + ".modes");
+        std::string line;
+        while (std::getline(modes, line)) {
+            std::istringstream ss(line);
+            std::string kind;
+            uint64_t offset;
+            if (!(ss >> kind >> offset)) {
+                continue;
+            }
+            if (kind == "end") {
+                end = offset;
+                has_end = true;
+                continue;
+            }
+            uint64_t dropped;
+            if (kind == "gap" && ss >> dropped) {
+                // The data is contiguous in the file, not in time.
+                std::cerr << "The recorder dropped " << dropped
+                          << " bytes before byte " << offset
+                          << ", the samples there jump in time." << std::endl;
+                continue;
+            }
+            unsigned devmode;
+            if (kind != "mode" || !(ss >> devmode)) {
+                continue;
+            }
+            const SiGeMode *mode = FindSiGeMode(devmode);
+            if (mode == nullptr) {
+                std::cerr << "Bad modes line: " << line << std::endl;
+                exit(1);
+            }
+            changes.emplace_back(offset, mode);
+        }
+
+        std::vector<Span> spans;
+        if (changes.empty()) {
+            spans.push_back({0, total, FindSiGeMode(
+                    static_cast<unsigned>(FLAGS_devmode))});
+            return spans;
+        }
+        if (!has_end) {
+            end = std::max(total, changes.back().first);
+            if (end > total) {
+                std::cerr << "The modes file has no end line, the data after "
+                          << "the last change is taken as the previous mode."
+                          << std::endl;
+            }
+        }
+        const uint64_t oldest = end > total ? end - total : 0;
+        for (size_t i = 0; i < changes.size(); ++i) {
+            uint64_t begin = std::max(changes[i].first, oldest);
+            uint64_t stop = i + 1 < changes.size()
+                            ? std::min(changes[i + 1].first, end) : end;
+            while (begin < stop && total > 0) {
+                // Cut where the file wrapped.
+                uint64_t start = begin % total;
+                uint64_t length = std::min(stop - begin, total - start);
+                spans.push_back({start, start + length, changes[i].second});
+                begin += length;
+            }
+        }
+        return spans;
+    }
+
+    // Converts one span to output.sigmf-data and output.sigmf-meta.
+    bool ConvertSpan(const std::vector<Segment> &segments,
+                     const std::vector<std::pair<uint64_t, uint64_t>> &gaps,
+                     const Span &span, const std::string &output,
+                     unsigned thread_count) {
+        const SiGeMode &mode = *span.mode;
+        const size_t value_size = FLAGS_format == "int8" ? 1 : 2;
+        size_t expansion;
+        const std::vector<uint8_t> table = BuildTable(mode, value_size,
+                                                      &expansion);
+
+        // Work items: the segments within the span, cut to at most a chunk.
+        const uint64_t chunk_size =
+                static_cast<uint64_t>(std::max(FLAGS_chunkmb, 1u)) << 20;
+        std::vector<Segment> work;
+        for (const auto &segment : segments) {
+            uint64_t begin = std::max(segment.logical_offset, span.start);
+            uint64_t end = std::min(segment.logical_offset + segment.length,
+                                    span.end);
+            for (uint64_t done = begin; done < end; done += chunk_size) {
+                work.push_back({segment.fd,
+                                segment.offset + done - segment.logical_offset,
+                                std::min(chunk_size, end - done),
+                                done - span.start});
+            }
+        }
+
+        const std::string data_path = output + ".sigmf-data";
+        const uint64_t total = span.end - span.start;
+        int out_fd = open(data_path.c_str(),
+                          O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (out_fd < 0 ||
+            ftruncate(out_fd, static_cast<off_t>(total * expansion))) {
+            std::cerr << "Couldn't create " << data_path << ": "
+                      << strerror(errno) << std::endl;
+            return false;
+        }
+
+        std::atomic<size_t> next_item(0);
+        std::atomic<bool> failed(false);
+        auto worker = [&]() {
+            // A chunk goes through in blocks, so a worker's memory doesn't
+            // grow with --chunkmb and the output format.
+            std::vector<uint8_t> in(kBlockSize);
+            std::vector<uint8_t> out(kBlockSize * expansion);
+            while (!failed) {
+                size_t item = next_item++;
+                if (item >= work.size()) {
+                    return;
+                }
+                const Segment &piece = work[item];
+                for (uint64_t done = 0; done < piece.length && !failed;
+                     done += kBlockSize) {
+                    const size_t length = static_cast<size_t>(
+                            std::min<uint64_t>(kBlockSize,
+                                               piece.length - done));
+                    if (!PReadAll(piece.fd, in.data(), length,
+                                  piece.offset + done)) {
+                        std::cerr << "Read error: " << strerror(errno)
+                                  << std::endl;
+                        failed = true;
+                        return;
+                    }
+                    uint8_t *o = out.data();
+                    for (size_t i = 0; i < length; ++i, o += expansion) {
+                        memcpy(o, &table[in[i] * expansion], expansion);
+                    }
+                    if (!PWriteAll(out_fd, out.data(), length * expansion,
+                                   (piece.logical_offset + done) *
+                                   expansion)) {
+                        std::cerr << "Write error: " << strerror(errno)
+                                  << std::endl;
+                        failed = true;
+                        return;
+                    }
+                }
+            }
+        };
+        auto start = std::chrono::steady_clock::now();
+        std::vector<std::thread> threads;
+        for (unsigned i = 0; i < thread_count; ++i) {
+            threads.emplace_back(worker);
+        }
+        for (auto &thread : threads) {
+            thread.join();
+        }
+        if (failed || close(out_fd) < 0) {
+            return false;
+        }
+        double seconds = std::chrono::duration<double>(
+                std::chrono::steady_clock::now() - start).count();
+
+        const bool complex = mode.is_complex;
+        const std::string datatype = std::string(complex ? "c" : "r") +
+                                     (value_size == 1 ? "i8" : "i16_le");
+        std::vector<std::pair<uint64_t, uint64_t>> span_gaps;
+        for (const auto &gap : gaps) {
+            uint64_t begin = std::max(gap.first, span.start);
+            uint64_t end = std::min(gap.second, span.end);
+            if (begin < end) {
+                span_gaps.emplace_back((begin - span.start) * mode.pack_mode,
+                                       (end - span.start) * mode.pack_mode);
+            }
+        }
+        WriteMetadata(output + ".sigmf-meta", mode, datatype, span_gaps);
+
+        const uint64_t samples = total * mode.pack_mode;
+        std::cerr << samples << " samples (" << samples / mode.sample_rate
+                  << " s) of devmode " << static_cast<int>(mode.devmode)
+                  << " written to " << data_path << " in " << seconds
+                  << " s with " << thread_count << " threads." << std::endl;
+        // What a GNSS-SDR File_Signal_Source needs to read the data.
+        std::cout << "SignalSource.filename=" << data_path << std::endl
+                  << "SignalSource.item_type="
+                  << (complex ? (value_size == 1 ? "ibyte" : "ishort")
+                              : (value_size == 1 ? "byte" : "short"))
+                  << std::endl
+                  << "SignalSource.sampling_frequency="
+                  << static_cast<uint64_t>(mode.sample_rate) << std::endl
+                  << "; IF: " << mode.if_frequency << " Hz" << std::endl;
+        return true;
+    }
+}  // namespace
+
+int main(int argc, char *argv[]) {
+    gflags::SetUsageMessage(
+            "Converts packed IF recordings to SigMF. Usage: SiGeConvert [flags] <recording.bin | recording.manifest | recording.s0.bin recording.s1.bin ...>");
+    gflags::ParseCommandLineFlags(&argc, &argv, true);
+    if (argc < 2) {
+        gflags::ShowUsageWithFlags(argv[0]);
+        return 1;
+    }
+    const std::vector<std::string> inputs(argv + 1, argv + argc);
+    const std::string base = RecordingBase(inputs.front());
+    std::string output = FLAGS_output;
+    if (output.empty()) {
+        output = base;
+    }
+
+    const std::vector<Segment> segments = ReadSegments(inputs);
+    uint64_t total = 0;
+    for (const auto &segment : segments) {
+        total = std::max(total, segment.logical_offset + segment.length);
+    }
+    const std::vector<Span> spans = ReadSpans(base, total);
+    const auto gaps = FindGaps(segments);
+    for (const auto &gap : gaps) {
+        std::cerr << "Bytes " << gap.first << " to " << gap.second
+                  << " are missing, zero-filled in the output." << std::endl;
+    }
+
+    unsigned thread_count = FLAGS_threads;
+    if (thread_count == 0) {
+        thread_count = std::max(std::thread::hardware_concurrency(), 1u);
+    }
+    // A SigMF recording has a single sample rate, so every mode the
+    // recorder changed to gets a recording of its own.
+    for (size_t i = 0; i < spans.size(); ++i) {
+        std::string span_output = spans.size() == 1
+                                  ? output
+                                  : output + "_" + std::to_string(i);
+        if (!ConvertSpan(segments, gaps, spans[i], span_output,
+                         thread_count)) {
+            return 1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,562 @@
+#include "IFSink.h"
+#include "Tracer.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace {
+    constexpr size_t kDirectAlignment = 4096;
+}  // namespace
+
+FileIFSink::FileIFSink(const std::string &path, bool circular,
+                       int64_t max_size, const Options &options)
+        : circular_(circular), max_size_(max_size), options_(options),
+          batch_(nullptr), batch_filled_(0), offset_(0), sync_offset_(0),
+          previous_sync_offset_(0), previous_sync_size_(0),
+          has_failed_(false) {
+    int flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+    fd_ = open(path.c_str(), flags | (options_.direct ? O_DIRECT : 0), 0644);
+    if (fd_ < 0 && options_.direct) {
+        // Not every file system takes O_DIRECT (tmpfs doesn't).
+        std::cerr << time(nullptr) << " No O_DIRECT for the IF file: "
+                  << strerror(errno) << std::endl;
+        options_.direct = false;
+        fd_ = open(path.c_str(), flags, 0644);
+    }
+    if (fd_ < 0) {
+        std::cerr << time(nullptr) << " Couldn't open file." << std::endl;
+        has_failed_ = true;
+        return;
+    }
+    std::cerr << time(nullptr) << " Could open file." << std::endl;
+
+    if (options_.direct) {
+        options_.write_size = std::max(options_.write_size, kDirectAlignment);
+        options_.write_size = (options_.write_size + kDirectAlignment - 1) /
+                              kDirectAlignment * kDirectAlignment;
+    }
+    if (options_.write_size > 0) {
+        void *batch = nullptr;
+        if (posix_memalign(&batch, kDirectAlignment, options_.write_size)) {
+            std::cerr << time(nullptr) << " Couldn't allocate the IF write "
+                      << "batch, writing every buffer." << std::endl;
+            options_.write_size = 0;
+        }
+        batch_ = static_cast<uint8_t *>(batch);
+    }
+}
+
+void FileIFSink::Write(const uint8_t *buffer, const size_t size) {
+    if (options_.write_size == 0) {
+        WriteOut(buffer, size);
+        return;
+    }
+    size_t done = 0;
+    while (done < size) {
+        size_t part = std::min(size - done,
+                               options_.write_size - batch_filled_);
+        memcpy(batch_ + batch_filled_, buffer + done, part);
+        batch_filled_ += part;
+        done += part;
+        if (batch_filled_ == options_.write_size) {
+            WriteOut(batch_, batch_filled_);
+            batch_filled_ = 0;
+        }
+    }
+}
+
+void FileIFSink::WriteOut(const uint8_t *data, size_t size) {
+    if (fd_ < 0) {
+        return;
+    }
+    TRACE_EVENT(TraceEvent::kFlushBegin, 0);
+    size_t done = 0;
+    while (done < size) {
+        ssize_t written = pwrite(fd_, data + done, size - done,
+                                 offset_ + static_cast<int64_t>(done));
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (!has_failed_) {
+                std::cerr << time(nullptr) << " Couldn't write IF file: "
+                          << strerror(errno) << std::endl;
+                has_failed_ = true;
+            }
+            break;
+        }
+        done += static_cast<size_t>(written);
+    }
+    offset_ += static_cast<int64_t>(size);
+
+    if (options_.sync != Sync::kNone &&
+        offset_ - sync_offset_ >= static_cast<int64_t>(options_.sync_size)) {
+        if (options_.sync == Sync::kData) {
+            fdatasync(fd_);
+        } else {
+            // Start writeback of this window, wait for the previous one and
+            // drop it from the page cache.
+            sync_file_range(fd_, sync_offset_, offset_ - sync_offset_,
+                            SYNC_FILE_RANGE_WRITE);
+            if (previous_sync_size_ > 0) {
+                sync_file_range(fd_, previous_sync_offset_,
+                                previous_sync_size_,
+                                SYNC_FILE_RANGE_WAIT_BEFORE |
+                                SYNC_FILE_RANGE_WRITE |
+                                SYNC_FILE_RANGE_WAIT_AFTER);
+                posix_fadvise(fd_, previous_sync_offset_, previous_sync_size_,
+                              POSIX_FADV_DONTNEED);
+            }
+            previous_sync_offset_ = sync_offset_;
+            previous_sync_size_ = offset_ - sync_offset_;
+        }
+        sync_offset_ = offset_;
+    }
+    TRACE_EVENT(TraceEvent::kFlushEnd, 0);
+
+    if (circular_ && offset_ > max_size_) {
+        std::cerr << time(nullptr) << " A new circle. Last tellp location: "
+                  << offset_ << std::endl;
+        offset_ = 0;
+        sync_offset_ = 0;
+        previous_sync_size_ = 0;
+    }
+}
+
+FileIFSink::~FileIFSink() {
+    if (batch_filled_ > 0 && fd_ >= 0) {
+        if (options_.direct) {
+            // The tail isn't a whole aligned block.
+            fcntl(fd_, F_SETFL, fcntl(fd_, F_GETFL) & ~O_DIRECT);
+        }
+        WriteOut(batch_, batch_filled_);
+    }
+    std::cerr << time(nullptr) << " Stopping write. Tellp location: "
+              << offset_ << std::endl;
+    if (fd_ >= 0) {
+        close(fd_);
+    }
+    free(batch_);
+}
+
+namespace {
+    // write() until everything is written or an error occurs.
+    bool WriteAll(int fd, const uint8_t *data, size_t size) {
+        while (size > 0) {
+            ssize_t written = write(fd, data, size);
+            if (written < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return false;
+            }
+            data += written;
+            size -= static_cast<size_t>(written);
+        }
+        return true;
+    }
+}  // namespace
+
+StripedIFSink::StripedIFSink(const std::vector<std::string> &directories,
+                             const std::string &name, size_t chunk_size,
+                             Placement placement)
+        : chunk_size_(chunk_size), placement_(placement),
+          stop_request_(false), writing_(0), next_target_(0) {
+    current_.sequence = 0;
+    current_.data.reserve(chunk_size_);
+
+    std::ofstream manifest(directories.front() + "/" + name + ".manifest");
+    if (!manifest.is_open() || !manifest.good()) {
+        std::cerr << time(nullptr) << " Couldn't open stripe manifest."
+                  << std::endl;
+    }
+    manifest << "# VISTA striped IF manifest v2" << std::endl;
+    manifest << "chunk_size " << chunk_size_ << std::endl;
+
+    for (size_t i = 0; i < directories.size(); ++i) {
+        std::unique_ptr<Target> target(new Target);
+        target->path = directories[i] + "/" + name + ".s" + std::to_string(i) +
+                       ".bin";
+        target->fd = open(target->path.c_str(),
+                          O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        target->failed = target->fd < 0;
+        target->offset = 0;
+        target->latency = 0;
+        if (target->failed) {
+            std::cerr << time(nullptr) << " Couldn't open stripe "
+                      << target->path << ": " << strerror(errno) << std::endl;
+        } else {
+            std::cerr << time(nullptr) << " Could open stripe " << target->path
+                      << "." << std::endl;
+        }
+        manifest << "target " << i << " " << target->path << std::endl;
+        targets_.push_back(std::move(target));
+    }
+    for (size_t i = 0; i < targets_.size(); ++i) {
+        targets_[i]->thread = std::thread(&StripedIFSink::TargetThread, this,
+                                          i);
+    }
+}
+
+void StripedIFSink::Write(const uint8_t *buffer, const size_t size) {
+    size_t offset = 0;
+    while (offset < size) {
+        size_t length = std::min(size - offset,
+                                 chunk_size_ - current_.data.size());
+        current_.data.insert(current_.data.end(), buffer + offset,
+                             buffer + offset + length);
+        offset += length;
+        if (current_.data.size() == chunk_size_) {
+            uint64_t next_sequence = current_.sequence + 1;
+            std::unique_lock<std::mutex> lock(mutex_);
+            Place(std::move(current_), lock);
+            lock.unlock();
+            current_ = Chunk();
+            current_.sequence = next_sequence;
+            current_.data.reserve(chunk_size_);
+        }
+    }
+}
+
+void StripedIFSink::Place(Chunk chunk, std::unique_lock<std::mutex> &lock) {
+    const size_t count = targets_.size();
+    while (true) {
+        size_t chosen = count;
+        bool any_alive = false;
+        double best_cost = 0;
+        for (size_t i = 0; i < count; ++i) {
+            size_t index = (next_target_ + i) % count;
+            const Target &target = *targets_[index];
+            any_alive |= !target.failed;
+            if (target.failed || target.queue.size() >= kMaxQueuedChunks) {
+                continue;
+            }
+            if (placement_ == Placement::kRoundRobin) {
+                chosen = index;
+                break;
+            }
+            // Time this target needs to get through its queue and the chunk.
+            double cost = (target.queue.size() + 1) * target.latency;
+            if (chosen == count || cost < best_cost) {
+                chosen = index;
+                best_cost = cost;
+            }
+        }
+        if (chosen < count) {
+            next_target_ = (chosen + 1) % count;
+            targets_[chosen]->queue.push_back(std::move(chunk));
+            condition_.notify_all();
+            return;
+        }
+        if (!any_alive) {
+            std::cerr << time(nullptr) << " All stripes failed, chunk "
+                      << chunk.sequence << " lost." << std::endl;
+            return;
+        }
+        // Every device is behind, nothing to do but wait for one of them.
+        condition_.wait(lock);
+    }
+}
+
+bool StripedIFSink::IsDrained() const {
+    if (!stop_request_ || writing_ > 0) {
+        return false;
+    }
+    for (const auto &target : targets_) {
+        if (!target->failed && !target->queue.empty()) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void StripedIFSink::TargetThread(size_t index) {
+    Target &target = *targets_[index];
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (!target.failed) {
+        condition_.wait(lock, [this, &target] {
+            return !target.queue.empty() || IsDrained();
+        });
+        if (target.queue.empty()) {
+            break;  // Stopping and nothing left anywhere.
+        }
+        Chunk chunk = std::move(target.queue.front());
+        target.queue.pop_front();
+        ++writing_;
+        condition_.notify_all();  // Room for another chunk.
+        lock.unlock();
+
+        StripeChunkHeader header = {StripeChunkHeader::kMagic,
+                                    static_cast<uint32_t>(chunk.data.size()),
+                                    chunk.sequence,
+                                    chunk.sequence * chunk_size_};
+        auto start = std::chrono::steady_clock::now();
+        bool ok = WriteAll(target.fd, reinterpret_cast<const uint8_t *>(&header),
+                           sizeof(header)) &&
+                  WriteAll(target.fd, chunk.data.data(), chunk.data.size());
+        double latency = std::chrono::duration<double>(
+                std::chrono::steady_clock::now() - start).count();
+
+        lock.lock();
+        --writing_;
+        if (!ok) {
+            std::cerr << time(nullptr) << " Couldn't write stripe "
+                      << target.path << ": " << strerror(errno)
+                      << ". Dropping it." << std::endl;
+            target.failed = true;
+            std::deque<Chunk> orphans;
+            orphans.swap(target.queue);
+            orphans.push_front(std::move(chunk));
+            for (auto &orphan : orphans) {
+                Place(std::move(orphan), lock);
+            }
+            condition_.notify_all();
+            break;
+        }
+        target.offset += sizeof(header) + chunk.data.size();
+        target.latency = target.latency == 0 ? latency :
+                         0.8 * target.latency + 0.2 * latency;
+        condition_.notify_all();  // Maybe the last one, see IsDrained.
+    }
+}
+
+StripedIFSink::~StripedIFSink() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (!current_.data.empty()) {
+        Place(std::move(current_), lock);
+    }
+    stop_request_ = true;
+    condition_.notify_all();
+    lock.unlock();
+    for (auto &target : targets_) {
+        target->thread.join();
+    }
+    for (auto &target : targets_) {
+        if (target->fd >= 0) {
+            close(target->fd);
+        }
+        std::cerr << time(nullptr) << " Stopping stripe " << target->path
+                  << ". Size: " << target->offset << std::endl;
+    }
+}
+
+SharedMemoryIFSink::SharedMemoryIFSink(const std::string &name,
+                                       uint32_t slot_count, uint32_t slot_size)
+        : name_(name), mapping_size_(MappingSize(slot_count, slot_size)),
+          mapping_(nullptr), header_(nullptr), slot_sequence_(nullptr),
+          slot_length_(nullptr), slot_data_(nullptr), sequence_(0) {
+    if (slot_count == 0 || slot_size == 0) {
+        std::cerr << time(nullptr) << " Shared memory " << name_
+                  << " needs at least one slot of at least one byte."
+                  << std::endl;
+        return;
+    }
+    // Readers only ever get read permission on the object.
+    int fd = shm_open(name_.c_str(), O_CREAT | O_RDWR | O_TRUNC, 0644);
+    if (fd < 0) {
+        std::cerr << time(nullptr) << " Couldn't create shared memory "
+                  << name_ << ": " << strerror(errno) << std::endl;
+        return;
+    }
+    if (ftruncate(fd, static_cast<off_t>(mapping_size_)) < 0) {
+        std::cerr << time(nullptr) << " Couldn't size shared memory "
+                  << name_ << ": " << strerror(errno) << std::endl;
+        close(fd);
+        shm_unlink(name_.c_str());
+        return;
+    }
+    void *mapping = mmap(nullptr, mapping_size_, PROT_READ | PROT_WRITE,
+                         MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        std::cerr << time(nullptr) << " Couldn't map shared memory "
+                  << name_ << ": " << strerror(errno) << std::endl;
+        shm_unlink(name_.c_str());
+        return;
+    }
+    // Keep the ring resident, a page fault in the writer is a disk access.
+    mlock(mapping, mapping_size_);
+
+    mapping_ = static_cast<uint8_t *>(mapping);
+    header_ = new(mapping_) IFSharedMemoryHeader;
+    slot_sequence_ = reinterpret_cast<std::atomic<uint64_t> *>(
+            mapping_ + SlotSequenceOffset());
+    for (uint32_t i = 0; i < slot_count; ++i) {
+        new(slot_sequence_ + i) std::atomic<uint64_t>(0);
+    }
+    slot_length_ = reinterpret_cast<uint32_t *>(
+            mapping_ + SlotLengthOffset(slot_count));
+    slot_data_ = mapping_ + SlotDataOffset(slot_count);
+
+    header_->slot_count = slot_count;
+    header_->slot_size = slot_size;
+    header_->version = IFSharedMemoryHeader::kVersion;
+    header_->write_sequence.store(0, std::memory_order_relaxed);
+    // Magic goes last, a reader seeing it may trust the rest of the header.
+    std::atomic_thread_fence(std::memory_order_release);
+    header_->magic = IFSharedMemoryHeader::kMagic;
+
+    std::cerr << time(nullptr) << " Shared memory ring " << name_ << " ("
+              << slot_count << " x " << slot_size << " bytes) ready."
+              << std::endl;
+}
+
+void SharedMemoryIFSink::Write(const uint8_t *buffer, const size_t size) {
+    if (mapping_ == nullptr) {
+        return;
+    }
+    const uint32_t slot_count = header_->slot_count;
+    const uint32_t slot_size = header_->slot_size;
+    // Buffers larger than a slot are spread over consecutive slots.
+    for (size_t offset = 0; offset < size; offset += slot_size) {
+        const uint32_t length = static_cast<uint32_t>(
+                std::min<size_t>(slot_size, size - offset));
+        const uint64_t sequence = ++sequence_;
+        const uint32_t slot = static_cast<uint32_t>(sequence % slot_count);
+
+        // Invalidate the slot first, so a reader copying it concurrently sees
+        // the sequence change and throws its copy away.
+        slot_sequence_[slot].store(0, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        memcpy(slot_data_ + static_cast<size_t>(slot) * slot_size,
+               buffer + offset, length);
+        slot_length_[slot] = length;
+        slot_sequence_[slot].store(sequence, std::memory_order_release);
+        header_->write_sequence.store(sequence, std::memory_order_release);
+    }
+}
+
+SharedMemoryIFSink::~SharedMemoryIFSink() {
+    if (mapping_ != nullptr) {
+        munmap(mapping_, mapping_size_);
+        shm_unlink(name_.c_str());
+    }
+}
+
+size_t SharedMemoryIFSink::SlotSequenceOffset() {
+    return sizeof(IFSharedMemoryHeader);
+}
+
+size_t SharedMemoryIFSink::SlotLengthOffset(uint32_t slot_count) {
+    return SlotSequenceOffset() + slot_count * sizeof(uint64_t);
+}
+
+size_t SharedMemoryIFSink::SlotDataOffset(uint32_t slot_count) {
+    // Slot data starts on a cache line so that memcpy runs at full speed.
+    size_t end = SlotLengthOffset(slot_count) + slot_count * sizeof(uint32_t);
+    return (end + 63) & ~static_cast<size_t>(63);
+}
+
+size_t SharedMemoryIFSink::MappingSize(uint32_t slot_count,
+                                       uint32_t slot_size) {
+    return SlotDataOffset(slot_count) +
+           static_cast<size_t>(slot_count) * slot_size;
+}
+
+UnixSocketIFSink::UnixSocketIFSink(const std::string &path,
+                                   size_t message_size)
+        : path_(path), message_size_(std::max<size_t>(message_size, 1)),
+          listen_fd_(-1), sequence_(0) {
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    if (path_.size() >= sizeof(address.sun_path)) {
+        std::cerr << time(nullptr) << " Socket path too long: " << path_
+                  << std::endl;
+        return;
+    }
+    strncpy(address.sun_path, path_.c_str(), sizeof(address.sun_path) - 1);
+
+    listen_fd_ = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                        0);
+    if (listen_fd_ < 0) {
+        std::cerr << time(nullptr) << " Couldn't create socket: "
+                  << strerror(errno) << std::endl;
+        return;
+    }
+    unlink(path_.c_str());  // Left over from a previous run.
+    if (bind(listen_fd_, reinterpret_cast<sockaddr *>(&address),
+             sizeof(address)) < 0 || listen(listen_fd_, 4) < 0) {
+        std::cerr << time(nullptr) << " Couldn't listen on " << path_ << ": "
+                  << strerror(errno) << std::endl;
+        close(listen_fd_);
+        listen_fd_ = -1;
+        return;
+    }
+    std::cerr << time(nullptr) << " Streaming IF on " << path_ << "."
+              << std::endl;
+}
+
+void UnixSocketIFSink::AcceptSubscribers() {
+    while (true) {
+        int fd = accept4(listen_fd_, nullptr, nullptr,
+                         SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            return;  // EAGAIN: nobody else is waiting.
+        }
+        subscribers_.push_back({fd, 0});
+        std::cerr << time(nullptr) << " IF subscriber connected on " << path_
+                  << "." << std::endl;
+    }
+}
+
+void UnixSocketIFSink::Write(const uint8_t *buffer, const size_t size) {
+    if (listen_fd_ < 0) {
+        return;
+    }
+    AcceptSubscribers();
+
+    // A message must fit the socket's send buffer, larger buffers are split.
+    for (size_t offset = 0; offset < size; offset += message_size_) {
+        uint64_t sequence = ++sequence_;
+        iovec iov[2];
+        iov[0].iov_base = &sequence;
+        iov[0].iov_len = sizeof(sequence);
+        iov[1].iov_base = const_cast<uint8_t *>(buffer + offset);
+        iov[1].iov_len = std::min(message_size_, size - offset);
+        msghdr message = {};
+        message.msg_iov = iov;
+        message.msg_iovlen = 2;
+
+        for (auto it = subscribers_.begin(); it != subscribers_.end();) {
+            ssize_t sent = sendmsg(it->fd, &message,
+                                   MSG_DONTWAIT | MSG_NOSIGNAL);
+            bool drop_subscriber = false;
+            if (sent >= 0) {
+                it->dropped_in_a_row = 0;
+            } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                drop_subscriber =
+                        ++it->dropped_in_a_row >= kMaxDroppedBuffers;
+            } else {
+                // EPIPE and friends: subscriber is gone.
+                drop_subscriber = true;
+            }
+            if (drop_subscriber) {
+                std::cerr << time(nullptr) << " IF subscriber on " << path_
+                          << " disconnected." << std::endl;
+                close(it->fd);
+                it = subscribers_.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+}
+
+UnixSocketIFSink::~UnixSocketIFSink() {
+    for (auto &subscriber : subscribers_) {
+        close(subscriber.fd);
+    }
+    if (listen_fd_ >= 0) {
+        close(listen_fd_);
+        unlink(path_.c_str());
+    }
+}
@@ -0,0 +1,256 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// An IFSink is a consumer of packed IF data. WriteIFToFileThread owns a list
+// of sinks and hands every packed buffer to each of them in order, so adding
+// a consumer never needs another copy of the data or another thread.
+//
+// Sinks are called from the writer thread only. A sink must never block the
+// writer on a slow reader -- whatever happens downstream of the sink (disk
+// excluded) is the reader's problem, not the recorder's.
+class IFSink {
+public:
+    virtual ~IFSink() = default;
+
+    virtual void Write(const uint8_t *buffer, const size_t size) = 0;
+};
+
+// Writes the packed IF data to a file, optionally wrapping around (circular
+// mode) once the file grows past a given size.
+//
+// How the data reaches the card is tunable, SiGeStorageBench finds what suits
+// a given card. By default every buffer is written as it comes and left to
+// the page cache. Buffers can be gathered into larger writes, written with
+// O_DIRECT (which needs, and gets, 4 KB aligned writes), and written back
+// every few MB, either asynchronously (sync_file_range, waiting only for the
+// previous window so the page cache never holds much dirty data) or with
+// fdatasync.
+class FileIFSink : public IFSink {
+public:
+    enum class Sync {
+        kNone,
+        kRange,
+        kData
+    };
+
+    struct Options {
+        // Bytes per write, 0 to write every buffer as it comes.
+        size_t write_size = 0;
+        bool direct = false;
+        Sync sync = Sync::kNone;
+        // Bytes between syncs.
+        size_t sync_size = 8 << 20;
+    };
+
+    FileIFSink(const std::string &path, bool circular, int64_t max_size,
+               const Options &options);
+
+    void Write(const uint8_t *buffer, const size_t size) override;
+
+    ~FileIFSink() override;
+
+private:
+    void WriteOut(const uint8_t *data, size_t size);
+
+    int fd_;
+    bool circular_;
+    int64_t max_size_;
+    Options options_;
+    // Batch of write_size bytes, aligned for O_DIRECT.
+    uint8_t *batch_;
+    size_t batch_filled_;
+    int64_t offset_;
+    // Start of the data not yet handed to writeback, and the previous
+    // window handed to it.
+    int64_t sync_offset_;
+    int64_t previous_sync_offset_;
+    int64_t previous_sync_size_;
+    bool has_failed_;
+};
+
+// Precedes every chunk in a stripe file, in host byte order.
+struct StripeChunkHeader {
+    static constexpr uint32_t kMagic = 0x43545356;  // "VSTC"
+
+    uint32_t magic;
+    uint32_t length;
+    uint64_t sequence;
+    // Offset of the chunk's first byte in the stream.
+    uint64_t stream_offset;
+};
+
+// Spreads the packed IF data over several files, one per target directory
+// (ideally each on its own device), so that the recording rate isn't bound to
+// what a single card sustains through its garbage collection pauses.
+//
+// The data is cut into chunks of chunk_size bytes numbered from 0. Each chunk
+// goes to one target, chosen round-robin or by latency (the target with the
+// least expected time to drain its queue), and is appended to that target's
+// file by the target's own thread. A target whose queue is full is skipped,
+// so a stall on one device is absorbed by the others; only when all of them
+// are full does Write block. A target that fails to write is dropped and its
+// chunks go to the remaining ones.
+//
+// Every chunk is preceded in its target's file by a StripeChunkHeader giving
+// its sequence number, length and offset in the stream, so each file
+// describes itself: the stream is put back together from whichever files
+// survive, missing chunks aside. A manifest next to the first target's file
+// lists the targets ("target <index> <path>" lines) and the chunk size; it is
+// written once at the start, so no target waits on the first device.
+//
+// Target threads keep running while stopping until every queue is empty and
+// no chunk is being written, so chunks a failing target hands back are still
+// written by the others.
+class StripedIFSink : public IFSink {
+public:
+    enum class Placement {
+        kRoundRobin, kLatency
+    };
+
+    // Files are named <directory>/<name>.s<target index>.bin and the manifest
+    // <first directory>/<name>.manifest.
+    StripedIFSink(const std::vector<std::string> &directories,
+                  const std::string &name, size_t chunk_size,
+                  Placement placement);
+
+    void Write(const uint8_t *buffer, const size_t size) override;
+
+    ~StripedIFSink() override;
+
+private:
+    struct Chunk {
+        uint64_t sequence;
+        std::vector<uint8_t> data;
+    };
+
+    struct Target {
+        std::string path;
+        int fd;
+        bool failed;
+        uint64_t offset;
+        std::deque<Chunk> queue;
+        // Moving average of the seconds taken to write one chunk.
+        double latency;
+        std::thread thread;
+    };
+
+    static constexpr size_t kMaxQueuedChunks = 16;
+
+    void TargetThread(size_t index);
+
+    // Whether target threads may exit: stopping, every queue empty and no
+    // chunk being written. Must be called with mutex_ held.
+    bool IsDrained() const;
+
+    // Queues the chunk on a target. Must be called with mutex_ held.
+    void Place(Chunk chunk, std::unique_lock<std::mutex> &lock);
+
+    size_t chunk_size_;
+    Placement placement_;
+    std::vector<std::unique_ptr<Target>> targets_;
+    std::mutex mutex_;
+    std::condition_variable condition_;
+    bool stop_request_;
+    // Chunks taken off a queue and not yet written or handed back.
+    size_t writing_;
+    size_t next_target_;
+    Chunk current_;
+};
+
+// Layout of the POSIX shared memory object created by SharedMemoryIFSink.
+// External processes shm_open() the object read-only and mmap() it.
+//
+// The ring is made of slot_count slots of slot_size bytes each. The writer
+// fills slot (sequence % slot_count), then publishes it by storing the slot's
+// sequence number into slot_sequence[] and bumping write_sequence. A reader
+// keeps its own next sequence number:
+//  - if it is equal to write_sequence, there is nothing new yet,
+//  - if write_sequence - next > slot_count, the reader fell behind and the
+//    slots in between were overwritten (the reader skips ahead),
+//  - otherwise it copies the slot out and re-checks slot_sequence[] for that
+//    slot afterwards; if it changed, the copy was torn by an overwrite.
+// Sequence numbers start at 1 so that 0 means "never written".
+struct IFSharedMemoryHeader {
+    static constexpr uint32_t kMagic = 0x56495354;  // "VIST"
+    static constexpr uint32_t kVersion = 1;
+
+    uint32_t magic;
+    uint32_t version;
+    uint32_t slot_count;
+    uint32_t slot_size;
+    std::atomic<uint64_t> write_sequence;
+    // Followed by slot_count entries of slot_sequence (std::atomic<uint64_t>),
+    // slot_count entries of slot_length (uint32_t, bytes used in the slot)
+    // and finally the slot data, see the offset functions below.
+};
+
+class SharedMemoryIFSink : public IFSink {
+public:
+    SharedMemoryIFSink(const std::string &name, uint32_t slot_count,
+                       uint32_t slot_size);
+
+    void Write(const uint8_t *buffer, const size_t size) override;
+
+    ~SharedMemoryIFSink() override;
+
+    // Offsets within the mapping, shared with readers.
+    static size_t SlotSequenceOffset();
+
+    static size_t SlotLengthOffset(uint32_t slot_count);
+
+    static size_t SlotDataOffset(uint32_t slot_count);
+
+    static size_t MappingSize(uint32_t slot_count, uint32_t slot_size);
+
+private:
+    std::string name_;
+    size_t mapping_size_;
+    uint8_t *mapping_;
+    IFSharedMemoryHeader *header_;
+    std::atomic<uint64_t> *slot_sequence_;
+    uint32_t *slot_length_;
+    uint8_t *slot_data_;
+    uint64_t sequence_;
+};
+
+// Streams the packed IF data to every process connected to a Unix domain
+// SOCK_SEQPACKET socket. Buffers are sent as messages of at most
+// message_size bytes (larger ones, e.g. fused batches, are split), each
+// prefixed by its 64-bit sequence number (starting at 1) so that a subscriber
+// can tell when it lost messages. Sends are non-blocking; a subscriber that
+// can't keep up loses whole messages, and one that stays full for
+// kMaxDroppedBuffers messages in a row is disconnected.
+class UnixSocketIFSink : public IFSink {
+public:
+    UnixSocketIFSink(const std::string &path, size_t message_size);
+
+    void Write(const uint8_t *buffer, const size_t size) override;
+
+    ~UnixSocketIFSink() override;
+
+private:
+    struct Subscriber {
+        int fd;
+        unsigned dropped_in_a_row;
+    };
+
+    void AcceptSubscribers();
+
+    static constexpr unsigned kMaxDroppedBuffers = 1024;
+
+    std::string path_;
+    size_t message_size_;
+    int listen_fd_;
+    std::vector<Subscriber> subscribers_;
+    uint64_t sequence_;
+};
@@ -0,0 +1,44 @@
+#include "LookupTable.h"
+
+#include <algorithm>
+#include <iostream>
+#include <sstream>
+#include <vector>
+
+static bool
+ValidateLookupTable(const char *flagname, const std::string &lookup_table_str) {
+    std::stringstream ss(lookup_table_str);
+    std::vector<char> lookup_table(4);
+    for (unsigned i = 0; i < lookup_table.size(); ++i) {
+        int num;
+        ss >> num;
+        lookup_table[i] = static_cast<char>(num);
+    }
+    std::sort(lookup_table.begin(), lookup_table.end());
+    if (ss.eof() && lookup_table[0] == -3 && lookup_table[1] == -1 &&
+        lookup_table[2] == 1 && lookup_table[3] == 3) {  // Lookup table ok.
+        return true;
+    }
+    std::cerr << "--" << flagname
+              << " must include numbers -3, -1, 1 and 3 once each."
+              << std::endl;
+    return false;
+}
+
+DEFINE_string(lookuptable, "1 3 -3 -1",
+              "Lookup table to use when mapping two bits to bytes in unpacked mode. Defaults to '1 3 -3 -1'");
+DEFINE_validator(lookuptable, ValidateLookupTable);
+
+std::array<int8_t, 4> GetLookupTable() {
+    if (!lookuptable_validator_registered) {
+        // Do nuthn.
+    }
+    std::array<int8_t, 4> lut = {{0, 1, 2, 3}};
+    std::stringstream ss(FLAGS_lookuptable);
+    for (unsigned i = 0; i < lut.size(); ++i) {
+        int num;
+        ss >> num;
+        lut[i] = static_cast<int8_t>(num);
+    }
+    return lut;
+}
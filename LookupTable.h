@@ -0,0 +1,10 @@
+#pragma once
+
+#include <array>
+#include <gflags/gflags.h>
+
+DECLARE_string(lookuptable);
+
+// Levels of the four 2-bit sample codes as given by --lookuptable, indexed by
+// the code itself.
+std::array<int8_t, 4> GetLookupTable();
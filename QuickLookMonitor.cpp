@@ -0,0 +1,320 @@
+#include "QuickLookMonitor.h"
+#include "LookupTable.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <ctime>
+#include <iomanip>
+#include <iostream>
+#include <pthread.h>
+#include <sched.h>
+#include <sstream>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace {
+    constexpr double kPi = 3.14159265358979323846;
+
+    double ThreadCPUSeconds() {
+        timespec ts;
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+        return ts.tv_sec + ts.tv_nsec * 1e-9;
+    }
+
+    // Only runs when nothing else wants the CPU, so that on a single core
+    // it never delays packing or writing. Failing that, the lowest nice.
+    void LowerThreadPriority() {
+        sched_param param = {};
+        if (pthread_setschedparam(pthread_self(), SCHED_IDLE, &param) != 0) {
+            setpriority(PRIO_PROCESS,
+                        static_cast<id_t>(syscall(SYS_gettid)), 19);
+        }
+    }
+
+    double ToDB(double power) {
+        return 10 * std::log10(std::max(power, 1e-20));
+    }
+}  // namespace
+
+QuickLookMonitor::QuickLookMonitor()
+        : period_seconds_(0), cpu_budget_percent_(0), wanted_(false),
+          stop_request_(false), is_running_(false), has_sample_(false),
+          sample_is_complex_(false), lut_(GetLookupTable()),
+          window_(kFFTSize), twiddles_(kFFTSize / 2), bit_reverse_(kFFTSize) {
+    for (unsigned i = 0; i < kFFTSize; ++i) {
+        window_[i] = static_cast<float>(
+                0.5 - 0.5 * std::cos(2 * kPi * i / kFFTSize));
+    }
+    for (unsigned i = 0; i < kFFTSize / 2; ++i) {
+        twiddles_[i] = std::polar(1.0f, static_cast<float>(
+                -2 * kPi * i / kFFTSize));
+    }
+    unsigned bits = 0;
+    while ((1u << bits) < kFFTSize) {
+        ++bits;
+    }
+    for (unsigned i = 0; i < kFFTSize; ++i) {
+        unsigned reversed = 0;
+        for (unsigned b = 0; b < bits; ++b) {
+            reversed |= ((i >> b) & 1) << (bits - 1 - b);
+        }
+        bit_reverse_[i] = reversed;
+    }
+    ResetAccumulators();
+}
+
+QuickLookMonitor::~QuickLookMonitor() {
+    Stop();
+}
+
+void QuickLookMonitor::Start(const std::string &name_log,
+                             unsigned period_seconds,
+                             double cpu_budget_percent) {
+    if (is_running_ || period_seconds == 0 || cpu_budget_percent <= 0) {
+        return;
+    }
+    name_log_ = name_log;
+    period_seconds_ = period_seconds;
+    cpu_budget_percent_ = std::min(cpu_budget_percent, 100.0);
+    stop_request_ = false;
+    has_sample_ = false;
+    ResetAccumulators();
+    thread_ = std::thread(&QuickLookMonitor::MonitorThread, this);
+    is_running_ = true;
+}
+
+void QuickLookMonitor::Stop() {
+    if (is_running_) {
+        wanted_ = false;
+        mutex_.lock();
+        stop_request_ = true;
+        mutex_.unlock();
+        condition_.notify_one();
+        thread_.join();
+        is_running_ = false;
+    }
+}
+
+void QuickLookMonitor::Offer(const uint8_t *buffer, const size_t size,
+                             bool is_complex) {
+    if (!wanted_.load(std::memory_order_relaxed)) {
+        return;
+    }
+    mutex_.lock();
+    if (!has_sample_) {
+        sample_.assign(buffer, buffer + size);
+        sample_is_complex_ = is_complex;
+        has_sample_ = true;
+        wanted_ = false;
+    }
+    mutex_.unlock();
+    condition_.notify_one();
+}
+
+void QuickLookMonitor::MonitorThread() {
+    LowerThreadPriority();
+    using clock = std::chrono::steady_clock;
+    const auto period = std::chrono::seconds(period_seconds_);
+    auto period_start = clock::now();
+    double period_cpu_start = ThreadCPUSeconds();
+    std::vector<uint8_t> buffer;
+    bool is_complex = false;
+
+    while (!stop_request_) {
+        // Wait for a buffer, or for the summary to be due.
+        bool got_buffer = false;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            wanted_ = true;
+            condition_.wait_until(lock, period_start + period, [this] {
+                return has_sample_ || stop_request_;
+            });
+            if (has_sample_) {
+                buffer.swap(sample_);
+                is_complex = sample_is_complex_;
+                has_sample_ = false;
+                got_buffer = true;
+            }
+        }
+
+        double cost = 0;
+        if (got_buffer) {
+            double cpu_start = ThreadCPUSeconds();
+            Analyze(buffer, is_complex);
+            cost = ThreadCPUSeconds() - cpu_start;
+        }
+
+        auto now = clock::now();
+        if (now >= period_start + period) {
+            double cpu_now = ThreadCPUSeconds();
+            Publish(std::chrono::duration<double>(now - period_start).count(),
+                    cpu_now - period_cpu_start);
+            ResetAccumulators();
+            period_start = now;
+            period_cpu_start = cpu_now;
+        }
+
+        // Stay within the budget: the time spent analyzing must be the given
+        // percentage of the time between two buffers.
+        if (cost > 0) {
+            auto pause = std::chrono::duration<double>(
+                    cost * (100 / cpu_budget_percent_ - 1));
+            std::unique_lock<std::mutex> lock(mutex_);
+            condition_.wait_for(lock, pause, [this] { return stop_request_; });
+        }
+    }
+    wanted_ = false;
+}
+
+void QuickLookMonitor::Analyze(const std::vector<uint8_t> &buffer,
+                               bool is_complex) {
+    if (acc_buffers_ > 0 && acc_is_complex_ != is_complex) {
+        ResetAccumulators();  // Mode changed, don't mix the two.
+    }
+    acc_is_complex_ = is_complex;
+    ++acc_buffers_;
+
+    // Levels, DC and I/Q balance over the whole buffer.
+    const size_t n = buffer.size();
+    std::vector<float> i_values(n);
+    std::vector<float> q_values(is_complex ? n : 0);
+    for (size_t k = 0; k < n; ++k) {
+        uint8_t i_code = buffer[k] & 0x03;
+        ++acc_i_levels_[i_code];
+        i_values[k] = lut_[i_code];
+        if (is_complex) {
+            uint8_t q_code = (buffer[k] >> 2) & 0x03;
+            ++acc_q_levels_[q_code];
+            q_values[k] = lut_[q_code];
+            acc_q_sum_ += q_values[k];
+            acc_q_power_ += q_values[k] * q_values[k];
+            acc_iq_product_ += i_values[k] * q_values[k];
+        }
+        acc_i_sum_ += i_values[k];
+        acc_i_power_ += i_values[k] * i_values[k];
+    }
+    acc_samples_ += n;
+
+    // Welch spectrum.
+    std::vector<std::complex<float>> segment(kFFTSize);
+    for (size_t start = 0; start + kFFTSize <= n; start += kFFTSize / 2) {
+        for (unsigned k = 0; k < kFFTSize; ++k) {
+            segment[k] = std::complex<float>(
+                    window_[k] * i_values[start + k],
+                    is_complex ? window_[k] * q_values[start + k] : 0.0f);
+        }
+        FFT(segment);
+        for (unsigned k = 0; k < kFFTSize; ++k) {
+            acc_power_[k] += std::norm(segment[k]);
+        }
+        ++acc_segments_;
+    }
+}
+
+void QuickLookMonitor::Publish(double elapsed_seconds, double cpu_seconds) {
+    std::ostringstream line;
+    line << time(nullptr) << " [" << name_log_ << "] QL buffers="
+         << acc_buffers_ << " cpu=" << std::fixed << std::setprecision(1)
+         << 100 * cpu_seconds / elapsed_seconds << "%";
+    if (acc_buffers_ == 0 || acc_segments_ == 0) {
+        line << " no data";
+        std::cerr << line.str() << std::endl;
+        return;
+    }
+
+    // Occupancy, listed by level from -3 to 3.
+    auto levels = [this](const std::array<uint64_t, 4> &counts) {
+        std::array<double, 4> by_level = {{0, 0, 0, 0}};
+        uint64_t total = 0;
+        for (unsigned code = 0; code < 4; ++code) {
+            by_level[(lut_[code] + 3) / 2] = counts[code];
+            total += counts[code];
+        }
+        std::ostringstream out;
+        for (unsigned i = 0; i < 4; ++i) {
+            out << (i ? "/" : "")
+                << static_cast<int>(std::lround(100 * by_level[i] / total));
+        }
+        return out.str();
+    };
+    const double samples = static_cast<double>(acc_samples_);
+    line << std::setprecision(3);
+    if (acc_is_complex_) {
+        line << " levels=I" << levels(acc_i_levels_) << ",Q"
+             << levels(acc_q_levels_) << " dc=" << acc_i_sum_ / samples << ","
+             << acc_q_sum_ / samples << " iq="
+             << ToDB(acc_q_power_ / acc_i_power_) << "dB,"
+             << acc_iq_product_ / std::sqrt(acc_i_power_ * acc_q_power_);
+    } else {
+        line << " levels=" << levels(acc_i_levels_) << " dc="
+             << acc_i_sum_ / samples;
+    }
+
+    // Spectrum: real data only has the first half of the bins, complex data is
+    // shifted so that it runs from -fs/2 to fs/2.
+    const unsigned bins = acc_is_complex_ ? kFFTSize : kFFTSize / 2 + 1;
+    std::vector<double> psd(bins);
+    for (unsigned k = 0; k < bins; ++k) {
+        unsigned bin = acc_is_complex_ ? (k + kFFTSize / 2) % kFFTSize : k;
+        psd[k] = acc_power_[bin] / acc_segments_;
+    }
+    std::vector<double> sorted(psd);
+    std::nth_element(sorted.begin(), sorted.begin() + bins / 2, sorted.end());
+    const double median = sorted[bins / 2];
+    const unsigned peak = static_cast<unsigned>(
+            std::max_element(psd.begin(), psd.end()) - psd.begin());
+    double peak_frequency = static_cast<double>(peak) / kFFTSize;
+    if (acc_is_complex_) {
+        peak_frequency -= 0.5;
+    }
+    line << " peak=" << std::setprecision(4) << peak_frequency << "fs,"
+         << std::setprecision(1) << ToDB(psd[peak] / median) << "dB bands=";
+    for (unsigned band = 0; band < kSummaryBands; ++band) {
+        unsigned first = band * bins / kSummaryBands;
+        unsigned last = (band + 1) * bins / kSummaryBands;
+        double power = 0;
+        for (unsigned k = first; k < last; ++k) {
+            power += psd[k];
+        }
+        power /= std::max(last - first, 1u);
+        line << (band ? "," : "") << std::lround(ToDB(power / median));
+    }
+    std::cerr << line.str() << std::endl;
+}
+
+void QuickLookMonitor::ResetAccumulators() {
+    acc_is_complex_ = false;
+    acc_buffers_ = 0;
+    acc_segments_ = 0;
+    acc_power_.assign(kFFTSize, 0);
+    acc_i_levels_.fill(0);
+    acc_q_levels_.fill(0);
+    acc_i_sum_ = 0;
+    acc_q_sum_ = 0;
+    acc_i_power_ = 0;
+    acc_q_power_ = 0;
+    acc_iq_product_ = 0;
+    acc_samples_ = 0;
+}
+
+void QuickLookMonitor::FFT(std::vector<std::complex<float>> &data) const {
+    for (unsigned i = 0; i < kFFTSize; ++i) {
+        if (i < bit_reverse_[i]) {
+            std::swap(data[i], data[bit_reverse_[i]]);
+        }
+    }
+    for (unsigned size = 2; size <= kFFTSize; size *= 2) {
+        const unsigned half = size / 2;
+        const unsigned step = kFFTSize / size;
+        for (unsigned start = 0; start < kFFTSize; start += size) {
+            for (unsigned k = 0; k < half; ++k) {
+                std::complex<float> t = twiddles_[k * step] *
+                                        data[start + k + half];
+                data[start + k + half] = data[start + k] - t;
+                data[start + k] += t;
+            }
+        }
+    }
+}
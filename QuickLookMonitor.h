@@ -0,0 +1,97 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <complex>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// The QuickLookMonitor gives a live view of what the RF front end sees,
+// without storing anything. It sits next to IFPackingThread, which offers it
+// every unpacked IF buffer. The monitor only takes (copies) a buffer when it
+// is ready for one, and it is ready for one only as often as its CPU budget
+// allows: after analyzing a buffer it sleeps long enough for the CPU time it
+// just spent to be the given percentage of the wall time. Offering a buffer
+// that isn't wanted costs a single atomic load.
+//
+// For every buffer taken, the monitor accumulates
+//  - a Welch power spectrum (Hann window, 50% overlap),
+//  - the occupancy of each of the four 2-bit levels,
+//  - the DC offset and, for complex data, the I/Q power balance and
+//    correlation,
+// with the samples mapped through the same lookup table as --lookuptable.
+// Every period, a one line summary is written to the log and the
+// accumulators start over.
+//
+// Unpacked real data has one sample in the low two bits of a byte. Unpacked
+// complex data has I in the low two bits and Q in the next two.
+class QuickLookMonitor {
+
+public:
+    QuickLookMonitor();
+
+    ~QuickLookMonitor();
+
+    QuickLookMonitor(const QuickLookMonitor &) = delete;
+
+    QuickLookMonitor operator=(const QuickLookMonitor &) = delete;
+
+    void Start(const std::string &name_log, unsigned period_seconds,
+               double cpu_budget_percent);
+
+    void Stop();
+
+    void Offer(const uint8_t *buffer, const size_t size, bool is_complex);
+
+private:
+    static constexpr unsigned kFFTSize = 256;
+    // Bands the spectrum is summarized into in the log line.
+    static constexpr unsigned kSummaryBands = 16;
+
+    void MonitorThread();
+
+    void Analyze(const std::vector<uint8_t> &buffer, bool is_complex);
+
+    void Publish(double elapsed_seconds, double cpu_seconds);
+
+    void ResetAccumulators();
+
+    void FFT(std::vector<std::complex<float>> &data) const;
+
+    std::string name_log_;
+    unsigned period_seconds_;
+    double cpu_budget_percent_;
+
+    std::atomic<bool> wanted_;
+    volatile bool stop_request_;
+    bool is_running_;
+    std::mutex mutex_;
+    std::condition_variable condition_;
+    bool has_sample_;
+    std::vector<uint8_t> sample_;
+    bool sample_is_complex_;
+    std::thread thread_;
+
+    std::array<int8_t, 4> lut_;
+    std::vector<float> window_;
+    std::vector<std::complex<float>> twiddles_;
+    std::vector<unsigned> bit_reverse_;
+
+    // Accumulators, only touched by MonitorThread.
+    bool acc_is_complex_;
+    uint64_t acc_buffers_;
+    uint64_t acc_segments_;
+    std::vector<double> acc_power_;
+    std::array<uint64_t, 4> acc_i_levels_;
+    std::array<uint64_t, 4> acc_q_levels_;
+    double acc_i_sum_;
+    double acc_q_sum_;
+    double acc_i_power_;
+    double acc_q_power_;
+    double acc_iq_product_;
+    uint64_t acc_samples_;
+};
@@ -0,0 +1,147 @@
+#include "Reactor.h"
+
+#include <cerrno>
+#include <cmath>
+#include <csignal>
+#include <cstring>
+#include <iostream>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+namespace {
+    constexpr int kMaxEvents = 16;
+
+    void ExitOnError(int result, const char *what) {
+        if (result < 0) {
+            std::cerr << time(nullptr) << " Reactor: " << what << " failed: "
+                      << strerror(errno) << std::endl;
+            exit(1);
+        }
+    }
+}  // namespace
+
+Reactor::Reactor() : signal_fd_(-1), stop_request_(false) {
+    epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+    ExitOnError(epoll_fd_, "epoll_create1");
+    stop_fd_ = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    ExitOnError(stop_fd_, "eventfd");
+    Watch(stop_fd_, EPOLLIN, [this](uint32_t) {
+        uint64_t count;
+        if (read(stop_fd_, &count, sizeof(count)) == sizeof(count)) {
+            stop_request_ = true;
+        }
+    });
+}
+
+Reactor::~Reactor() {
+    if (signal_fd_ >= 0) {
+        close(signal_fd_);
+    }
+    close(stop_fd_);
+    close(epoll_fd_);
+}
+
+void Reactor::Watch(int fd, uint32_t events, Handler handler) {
+    std::lock_guard<std::mutex> lock(mutex_handlers_);
+    epoll_event event = {};
+    event.events = events;
+    event.data.fd = fd;
+    int op = handlers_.count(fd) ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+    ExitOnError(epoll_ctl(epoll_fd_, op, fd, &event), "epoll_ctl");
+    handlers_[fd] = std::move(handler);
+}
+
+void Reactor::Unwatch(int fd) {
+    std::lock_guard<std::mutex> lock(mutex_handlers_);
+    if (handlers_.erase(fd)) {
+        epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, fd, nullptr);
+    }
+}
+
+int Reactor::AddTimer(double seconds, bool periodic,
+                      std::function<void()> handler) {
+    int timer = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+    ExitOnError(timer, "timerfd_create");
+    itimerspec spec = {};
+    double whole;
+    double fraction = modf(seconds, &whole);
+    spec.it_value.tv_sec = static_cast<time_t>(whole);
+    spec.it_value.tv_nsec = static_cast<long>(fraction * 1e9);
+    if (spec.it_value.tv_sec == 0 && spec.it_value.tv_nsec == 0) {
+        spec.it_value.tv_nsec = 1;  // Zero would disarm the timer.
+    }
+    if (periodic) {
+        spec.it_interval = spec.it_value;
+    }
+    ExitOnError(timerfd_settime(timer, 0, &spec, nullptr), "timerfd_settime");
+    Watch(timer, EPOLLIN, [this, timer, periodic, handler](uint32_t) {
+        uint64_t expirations;
+        if (read(timer, &expirations, sizeof(expirations)) !=
+            sizeof(expirations)) {
+            return;
+        }
+        if (!periodic) {
+            CancelTimer(timer);
+        }
+        handler();
+    });
+    return timer;
+}
+
+void Reactor::CancelTimer(int timer) {
+    Unwatch(timer);
+    close(timer);
+}
+
+void Reactor::WatchSignals(const std::vector<int> &signals,
+                           std::function<void(int signum)> handler) {
+    sigset_t mask;
+    sigemptyset(&mask);
+    for (int signum : signals) {
+        sigaddset(&mask, signum);
+    }
+    ExitOnError(pthread_sigmask(SIG_BLOCK, &mask, nullptr), "pthread_sigmask");
+    signal_fd_ = signalfd(signal_fd_, &mask, SFD_CLOEXEC | SFD_NONBLOCK);
+    ExitOnError(signal_fd_, "signalfd");
+    Watch(signal_fd_, EPOLLIN, [this, handler](uint32_t) {
+        signalfd_siginfo info;
+        while (read(signal_fd_, &info, sizeof(info)) == sizeof(info)) {
+            handler(static_cast<int>(info.ssi_signo));
+        }
+    });
+}
+
+void Reactor::Run() {
+    epoll_event events[kMaxEvents];
+    while (!stop_request_) {
+        int count = epoll_wait(epoll_fd_, events, kMaxEvents, -1 /* ms */);
+        if (count < 0 && errno != EINTR) {
+            ExitOnError(count, "epoll_wait");
+        }
+        for (int i = 0; i < count; ++i) {
+            Handler handler;
+            {
+                // The handler may have been removed by an earlier one.
+                std::lock_guard<std::mutex> lock(mutex_handlers_);
+                auto it = handlers_.find(events[i].data.fd);
+                if (it == handlers_.end()) {
+                    continue;
+                }
+                handler = it->second;
+            }
+            handler(events[i].events);
+        }
+    }
+    stop_request_ = false;
+}
+
+void Reactor::Stop() {
+    uint64_t one = 1;
+    if (write(stop_fd_, &one, sizeof(one)) < 0) {
+        std::cerr << time(nullptr) << " Reactor: couldn't stop: "
+                  << strerror(errno) << std::endl;
+    }
+}
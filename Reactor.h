@@ -0,0 +1,62 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <vector>
+
+// The Reactor waits on every event source of the control plane with a single
+// epoll_wait: signals (signalfd), timers (timerfd), the launch GPIO pins and
+// libusb's file descriptors, and runs the matching handler on its thread. It
+// replaces polling loops with sleeps, so that nothing wakes up unless there is
+// something to do and a stop takes effect at once.
+//
+// Handlers run on the thread calling Run and must not block. Watch, Unwatch,
+// AddTimer, CancelTimer and Stop may be called from any thread, including
+// from handlers.
+class Reactor {
+
+public:
+    // Gets the epoll events that fired.
+    using Handler = std::function<void(uint32_t events)>;
+
+    Reactor();
+
+    ~Reactor();
+
+    Reactor(const Reactor &) = delete;
+
+    Reactor operator=(const Reactor &) = delete;
+
+    void Watch(int fd, uint32_t events, Handler handler);
+
+    void Unwatch(int fd);
+
+    // Runs handler after seconds, and then every seconds if periodic. Returns
+    // an id for CancelTimer.
+    int AddTimer(double seconds, bool periodic, std::function<void()> handler);
+
+    void CancelTimer(int timer);
+
+    // Blocks the signals in the calling thread and runs handler for each of
+    // them that is caught. Threads inherit the signal mask, so this must be
+    // done before any other thread starts; the signals then only reach the
+    // Reactor. Signals must be sent to the process (kill), not to a thread
+    // (raise), to be seen.
+    void WatchSignals(const std::vector<int> &signals,
+                      std::function<void(int signum)> handler);
+
+    // Handles events until Stop is called.
+    void Run();
+
+    void Stop();
+
+private:
+    int epoll_fd_;
+    int stop_fd_;
+    int signal_fd_;
+    bool stop_request_;
+    std::mutex mutex_handlers_;
+    std::map<int, Handler> handlers_;
+};
@@ -1,4 +1,8 @@
 #include "RocketInterfaceMonitor.h"
+#include <fcntl.h>
+#include <fstream>
+#include <string>
+#include <unistd.h>
 #include <wiringPi.h>
 
 RocketInterfaceMonitor::RocketInterfaceMonitor() {
@@ -7,10 +11,49 @@ RocketInterfaceMonitor::RocketInterfaceMonitor() {
     digitalWrite(kPinLOb, 1);
 }
 
+RocketInterfaceMonitor::~RocketInterfaceMonitor() {
+    for (int fd : edge_fds_) {
+        close(fd);
+    }
+}
+
 void RocketInterfaceMonitor::SetStatus(bool status) {
     digitalWrite(kPinStatusPlus, !status);
 }
 
 bool RocketInterfaceMonitor::IsLaunched() {
     return !digitalRead(kPinLOa) || digitalRead(kPinIgnitPlus);
-}
\ No newline at end of file
+}
+
+std::vector<int> RocketInterfaceMonitor::OpenLaunchPinEdges() {
+    if (edge_fds_.empty()) {
+        for (int pin : {kPinLOa, kPinIgnitPlus}) {
+            std::string gpio = "/sys/class/gpio/gpio" + std::to_string(pin);
+            std::ifstream edge_file(gpio + "/edge");
+            std::string edge;
+            int fd = -1;
+            if (edge_file >> edge && edge != "none") {
+                fd = open((gpio + "/value").c_str(), O_RDONLY | O_CLOEXEC);
+            }
+            if (fd < 0) {
+                for (int opened : edge_fds_) {
+                    close(opened);
+                }
+                edge_fds_.clear();
+                break;
+            }
+            // Edges are only signalled after a first read.
+            ClearLaunchPinEdge(fd);
+            edge_fds_.push_back(fd);
+        }
+    }
+    return edge_fds_;
+}
+
+void RocketInterfaceMonitor::ClearLaunchPinEdge(int fd) {
+    char value[2];
+    lseek(fd, 0, SEEK_SET);
+    if (read(fd, value, sizeof(value)) < 0) {
+        // Nothing to do, the pin is read with IsLaunched anyway.
+    }
+}
@@ -1,13 +1,26 @@
 #pragma once
 
+#include <vector>
+
 class RocketInterfaceMonitor {
 public:
     RocketInterfaceMonitor();
 
+    ~RocketInterfaceMonitor();
+
     void SetStatus(bool status);
 
     bool IsLaunched();
 
+    // Opens the sysfs value files of the launch pins, which signal their
+    // edges with EPOLLPRI if edges were enabled (gpio edge <pin> both, see
+    // start_sige.sh). Returns none if any pin has no edges enabled, the pins
+    // then need to be polled with IsLaunched.
+    std::vector<int> OpenLaunchPinEdges();
+
+    // Acknowledges an edge on a file from OpenLaunchPinEdges.
+    static void ClearLaunchPinEdge(int fd);
+
 private:
     static constexpr int kPinStatusPlus = 6;
     // constexpr int kPinStatusReturn = 5;
@@ -15,4 +28,6 @@ private:
     // static constexpr int kPinIgnitReturn = 5;  // Connected to GND.
     static constexpr int kPinLOa = 19;
     static constexpr int kPinLOb = 13;
+
+    std::vector<int> edge_fds_;
 };
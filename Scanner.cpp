@@ -0,0 +1,662 @@
+// SiGeScan indexes legacy IF recordings: headerless _IF_ files, possibly
+// written in circular mode, with no wrap marker and no gap information.
+//
+// The file is cut into windows of --window packed transfer blocks (a block is
+// what one transfer packs to, all writes were whole blocks). Worker threads
+// mmap the file a slice at a time and take the histogram of the 2-bit sample
+// codes of every window; a chi-square test between neighbouring windows
+// scores how much the sample distribution breaks at each boundary. Scores
+// standing out from the rest are discontinuities, refined to the block.
+// All-zero windows are holes that were never written.
+//
+// The wrap point of a circular file is where the newest data meets the
+// oldest. The AGC file next to the recording gives how long it lasted (to the
+// second), hence how many bytes were written and where the last lap ended;
+// the strongest break around there is taken as the wrap point.
+//
+// The resulting index (<file>.index by default) lists the wrap point, breaks,
+// holes, the file's segments in time order, and a seek table from unix time
+// to file offset.
+
+#include "SiGeModes.h"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <dirent.h>
+#include <fcntl.h>
+#include <fstream>
+#include <gflags/gflags.h>
+#include <iomanip>
+#include <iostream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+static bool ValidateDevMode(const char *flagname, int32_t devmode) {
+    if (FindSiGeMode(static_cast<unsigned>(devmode)) != nullptr) {
+        return true;
+    }
+    std::cerr << "Invalid value for --" << flagname << ": " << devmode
+              << std::endl;
+    return false;
+}
+
+DEFINE_int32(devmode, 8, "Mode the recording was made with.");
+DEFINE_validator(devmode, ValidateDevMode);
+DEFINE_uint32(transfersize, 16384,
+              "IF transfer size the recording was made with.");
+DEFINE_string(agc, "",
+              "AGC file of the recording, defaults to the <name>_AGC_<time>.bin next to the IF file or under the working directory that started closest to it.");
+DEFINE_string(output, "", "Index file, defaults to <file>.index.");
+DEFINE_uint32(threads, 0, "Worker threads, 0 for one per core.");
+DEFINE_uint32(window, 64, "Transfer blocks per window.");
+DEFINE_double(breakfactor, 20,
+              "A break scores this many times the median score, at least.");
+DEFINE_double(minscore, 100, "A break scores this much, at least.");
+DEFINE_double(circulargb, 50,
+              "Size in GB past which the recorder wrapped circular files.");
+DEFINE_uint32(seekseconds, 1, "Period of the seek table.");
+
+namespace {
+    // Slices of the file mapped by a worker at a time, in windows.
+    constexpr size_t kWindowsPerSlice = 256;
+    // AGC timestamps are truncated to the second, at both ends.
+    constexpr double kAGCUncertaintySeconds = 2;
+    constexpr double kClockUncertainty = 1e-4;
+    // The recorder named its IF and AGC files from two clock readings.
+    constexpr int64_t kAGCNameSeconds = 60;
+
+    // Counts of the four I codes, then the four Q codes (complex only).
+    using Histogram = std::array<uint64_t, 8>;
+
+    // Per byte, the counts it adds to the I codes and the Q codes, 16 bits
+    // per code, so a block can be summed in one pass.
+    struct CountTables {
+        uint64_t i[256];
+        uint64_t q[256];
+    };
+
+    CountTables MakeCountTables(const SiGeMode &mode) {
+        CountTables tables = {};
+        for (unsigned byte = 0; byte < 256; ++byte) {
+            if (mode.is_complex) {
+                // Two samples per byte, I in the low two bits of each nibble.
+                for (unsigned nibble = 0; nibble < 2; ++nibble) {
+                    unsigned value = (byte >> (4 * nibble)) & 0x0F;
+                    tables.i[byte] += 1ull << (16 * (value & 0x03));
+                    tables.q[byte] += 1ull << (16 * (value >> 2));
+                }
+            } else {
+                for (unsigned sample = 0; sample < 4; ++sample) {
+                    tables.i[byte] += 1ull << (16 * ((byte >> (2 * sample)) &
+                                                     0x03));
+                }
+            }
+        }
+        return tables;
+    }
+
+    // Bytes summed before the 16-bit counts are moved out: a byte adds at
+    // most 4 to a count.
+    constexpr size_t kFlushBytes = 0xFFFF / 4;
+
+    // Adds one block to histogram.
+    void AddBlock(const CountTables &tables, const uint8_t *data, size_t size,
+                  Histogram *histogram) {
+        for (size_t run = 0; run < size; run += kFlushBytes) {
+            uint64_t i = 0;
+            uint64_t q = 0;
+            for (size_t k = run; k < std::min(size, run + kFlushBytes); ++k) {
+                i += tables.i[data[k]];
+                q += tables.q[data[k]];
+            }
+            for (unsigned code = 0; code < 4; ++code) {
+                (*histogram)[code] += (i >> (16 * code)) & 0xFFFF;
+                (*histogram)[4 + code] += (q >> (16 * code)) & 0xFFFF;
+            }
+        }
+    }
+
+    void Add(const Histogram &from, Histogram *to) {
+        for (size_t k = 0; k < from.size(); ++k) {
+            (*to)[k] += from[k];
+        }
+    }
+
+    // Two-sample chi-square statistic of homogeneity.
+    double ChiSquare(const Histogram &r, const Histogram &s) {
+        double r_total = 0;
+        double s_total = 0;
+        for (size_t k = 0; k < r.size(); ++k) {
+            r_total += r[k];
+            s_total += s[k];
+        }
+        if (r_total == 0 || s_total == 0) {
+            return 0;
+        }
+        const double kr = std::sqrt(s_total / r_total);
+        const double ks = std::sqrt(r_total / s_total);
+        double chi = 0;
+        for (size_t k = 0; k < r.size(); ++k) {
+            if (r[k] + s[k] > 0) {
+                double d = kr * r[k] - ks * s[k];
+                chi += d * d / (r[k] + s[k]);
+            }
+        }
+        return chi;
+    }
+
+    // Never written: every sample is code 0, which a live frontend never
+    // does for a whole window.
+    bool IsHole(const Histogram &histogram) {
+        return histogram[1] + histogram[2] + histogram[3] +
+               histogram[5] + histogram[6] + histogram[7] == 0;
+    }
+
+    struct Break {
+        uint64_t offset;
+        double score;
+    };
+
+    // A read-only view of length bytes at start of a file. mmap wants a page
+    // aligned offset, windows needn't be.
+    struct Mapping {
+        Mapping(int fd, uint64_t start, uint64_t length) {
+            static const uint64_t page_size =
+                    static_cast<uint64_t>(sysconf(_SC_PAGESIZE));
+            const uint64_t aligned = start / page_size * page_size;
+            size = static_cast<size_t>(length + start - aligned);
+            base = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd,
+                        static_cast<off_t>(aligned));
+            if (base == MAP_FAILED) {
+                std::cerr << "Couldn't map the file: " << strerror(errno)
+                          << std::endl;
+                exit(1);
+            }
+            madvise(base, size, MADV_SEQUENTIAL);
+            data = static_cast<const uint8_t *>(base) + (start - aligned);
+        }
+
+        ~Mapping() {
+            munmap(base, size);
+        }
+
+        Mapping(const Mapping &) = delete;
+
+        Mapping &operator=(const Mapping &) = delete;
+
+        void *base;
+        size_t size;
+        const uint8_t *data;
+    };
+
+    class Scanner {
+    public:
+        Scanner(int fd, uint64_t size, const SiGeMode &mode,
+                size_t block_size, unsigned thread_count)
+                : fd_(fd), size_(size), block_size_(block_size),
+                  window_size_(block_size * std::max(FLAGS_window, 1u)),
+                  thread_count_(thread_count),
+                  tables_(MakeCountTables(mode)) {}
+
+        // Histograms of every window, in parallel.
+        void Scan() {
+            windows_.assign((size_ + window_size_ - 1) / window_size_,
+                            Histogram());
+            const size_t slice_count =
+                    (windows_.size() + kWindowsPerSlice - 1) /
+                    kWindowsPerSlice;
+            std::atomic<size_t> next_slice(0);
+            auto worker = [&]() {
+                for (size_t slice = next_slice++; slice < slice_count;
+                     slice = next_slice++) {
+                    ScanSlice(slice);
+                }
+            };
+            std::vector<std::thread> threads;
+            for (unsigned i = 0; i < thread_count_; ++i) {
+                threads.emplace_back(worker);
+            }
+            for (auto &thread : threads) {
+                thread.join();
+            }
+
+            scores_.assign(windows_.size(), 0);
+            for (size_t i = 1; i < windows_.size(); ++i) {
+                scores_[i] = ChiSquare(windows_[i - 1], windows_[i]);
+            }
+        }
+
+        double Threshold() const {
+            std::vector<double> scores(scores_.begin() + std::min<size_t>(
+                    1, scores_.size()), scores_.end());
+            if (scores.empty()) {
+                return FLAGS_minscore;
+            }
+            std::nth_element(scores.begin(),
+                             scores.begin() + scores.size() / 2, scores.end());
+            return std::max(FLAGS_minscore,
+                            FLAGS_breakfactor * scores[scores.size() / 2]);
+        }
+
+        // Window boundaries scoring above threshold, refined to the block.
+        std::vector<Break> Breaks(double threshold) const {
+            std::vector<Break> breaks;
+            for (size_t i = 1; i < scores_.size(); ++i) {
+                if (scores_[i] < threshold || NearHole(i)) {
+                    continue;
+                }
+                Break found = Refine(i);
+                // Neighbouring boundaries may refine to the same block.
+                if (!breaks.empty() && breaks.back().offset == found.offset) {
+                    breaks.back().score = std::max(breaks.back().score,
+                                                   found.score);
+                } else {
+                    breaks.push_back(found);
+                }
+            }
+            return breaks;
+        }
+
+        // The strongest boundary between offsets first and last, holes'
+        // edges aside.
+        Break Strongest(uint64_t first, uint64_t last) const {
+            size_t best = 0;
+            for (size_t i = std::max<uint64_t>(first / window_size_, 1);
+                 i < scores_.size() && i * window_size_ <= last; ++i) {
+                if (NearHole(i)) {
+                    continue;
+                }
+                if (best == 0 || scores_[i] > scores_[best]) {
+                    best = i;
+                }
+            }
+            return best == 0 ? Break{0, 0} : Refine(best);
+        }
+
+        // Ranges of all-zero windows.
+        std::vector<std::pair<uint64_t, uint64_t>> Holes() const {
+            std::vector<std::pair<uint64_t, uint64_t>> holes;
+            for (size_t i = 0; i < windows_.size(); ++i) {
+                if (!IsHole(windows_[i])) {
+                    continue;
+                }
+                uint64_t start = i * window_size_;
+                uint64_t end = std::min<uint64_t>(start + window_size_, size_);
+                if (!holes.empty() && holes.back().second == start) {
+                    holes.back().second = end;
+                } else {
+                    holes.emplace_back(start, end);
+                }
+            }
+            return holes;
+        }
+
+    private:
+        // Whether boundary i is a hole's edge. A hole needn't start or end
+        // on a window, the window it partly covers is skewed too.
+        bool NearHole(size_t i) const {
+            for (size_t k = i >= 2 ? i - 2 : 0;
+                 k <= i + 1 && k < windows_.size(); ++k) {
+                if (IsHole(windows_[k])) {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        void ScanSlice(size_t slice) {
+            const uint64_t start = slice * kWindowsPerSlice * window_size_;
+            const uint64_t length = std::min<uint64_t>(
+                    kWindowsPerSlice * window_size_, size_ - start);
+            Mapping mapping(fd_, start, length);
+            const uint8_t *data = mapping.data;
+            for (uint64_t window = 0; window * window_size_ < length;
+                 ++window) {
+                Histogram &histogram =
+                        windows_[slice * kWindowsPerSlice + window];
+                for (uint64_t block = window * window_size_;
+                     block < std::min<uint64_t>((window + 1) * window_size_,
+                                                length);
+                     block += block_size_) {
+                    AddBlock(tables_, data + block,
+                             std::min<uint64_t>(block_size_, length - block),
+                             &histogram);
+                }
+            }
+        }
+
+        // Finds the block boundary around window boundary i that splits
+        // the windows on each side the most.
+        Break Refine(size_t i) const {
+            const uint64_t first = (i - 1) * window_size_;
+            const uint64_t last = std::min<uint64_t>((i + 1) * window_size_,
+                                                     size_);
+            std::vector<Histogram> blocks;
+            {
+                Mapping mapping(fd_, first, last - first);
+                for (uint64_t block = 0; first + block < last;
+                     block += block_size_) {
+                    blocks.emplace_back();
+                    AddBlock(tables_, mapping.data + block,
+                             std::min<uint64_t>(block_size_,
+                                                last - first - block),
+                             &blocks.back());
+                }
+            }
+
+            Break best = {i * window_size_, scores_[i]};
+            for (size_t split = 1; split < blocks.size(); ++split) {
+                Histogram before = {};
+                Histogram after = {};
+                for (size_t k = 0; k < split; ++k) {
+                    Add(blocks[k], &before);
+                }
+                for (size_t k = split; k < blocks.size(); ++k) {
+                    Add(blocks[k], &after);
+                }
+                // Scaled to windows, so scores compare with the others.
+                double score = ChiSquare(before, after) *
+                               (window_size_ / 2.0) /
+                               (blocks.size() * block_size_ / 4.0);
+                if (score > best.score) {
+                    best = {first + split * block_size_, score};
+                }
+            }
+            return best;
+        }
+
+        int fd_;
+        uint64_t size_;
+        uint64_t block_size_;
+        uint64_t window_size_;
+        unsigned thread_count_;
+        CountTables tables_;
+        std::vector<Histogram> windows_;
+        std::vector<double> scores_;
+    };
+
+    // First and last timestamps of an AGC file, false if there is none.
+    bool ReadAGCTimes(const std::string &path, uint32_t *first,
+                      uint32_t *last, uint64_t *samples) {
+        std::ifstream file(path, std::ios::binary);
+        uint32_t record[2];
+        *samples = 0;
+        while (file.read(reinterpret_cast<char *>(record), sizeof(record))) {
+            if (*samples == 0) {
+                *first = record[1];
+            }
+            *last = record[1];
+            ++*samples;
+        }
+        return *samples > 0;
+    }
+
+    // Unix time of a "%Y-%m-%dT%H-%M-%S" file name stamp, -1 if it isn't one.
+    int64_t ParseStamp(const std::string &stamp) {
+        tm fields = {};
+        const char *end = strptime(stamp.c_str(), "%Y-%m-%dT%H-%M-%S",
+                                   &fields);
+        if (end == nullptr || std::string(end) != ".bin") {
+            return -1;
+        }
+        return static_cast<int64_t>(timegm(&fields));
+    }
+
+    // The recorder wrote <name>_IF_<time>.bin to /<logname> but
+    // <name>_AGC_<time>.bin to <logname> under its working directory, each
+    // named from its own clock reading. Looks in the IF file's directory,
+    // under the working directory and in the working directory for the AGC
+    // file whose time is closest to the IF file's; empty if there is none.
+    std::string FindAGCFile(const std::string &input) {
+        const size_t slash = input.rfind('/');
+        const std::string directory = slash == std::string::npos ? "."
+                                      : slash == 0 ? "/"
+                                      : input.substr(0, slash);
+        const std::string file_name = input.substr(
+                slash == std::string::npos ? 0 : slash + 1);
+        const size_t if_tag = file_name.rfind("_IF_");
+        if (if_tag == std::string::npos) {
+            return "";
+        }
+        const std::string prefix = file_name.substr(0, if_tag) + "_AGC_";
+        const int64_t if_time = ParseStamp(file_name.substr(if_tag + 4));
+
+        std::vector<std::string> directories = {directory};
+        if (directory[0] == '/') {
+            directories.push_back("." + directory);
+        }
+        directories.push_back(".");
+        std::string best;
+        int64_t best_distance = kAGCNameSeconds + 1;
+        for (const auto &candidate_directory : directories) {
+            DIR *dir = opendir(candidate_directory.c_str());
+            if (dir == nullptr) {
+                continue;
+            }
+            while (dirent *entry = readdir(dir)) {
+                const std::string name = entry->d_name;
+                if (name.compare(0, prefix.size(), prefix) != 0) {
+                    continue;
+                }
+                const int64_t agc_time = ParseStamp(
+                        name.substr(prefix.size()));
+                if (agc_time < 0) {
+                    continue;
+                }
+                const int64_t distance = if_time < 0
+                                         ? 0 : std::abs(agc_time - if_time);
+                if (distance < best_distance) {
+                    best_distance = distance;
+                    best = candidate_directory +
+                           (candidate_directory.back() == '/' ? "" : "/") +
+                           name;
+                }
+            }
+            closedir(dir);
+        }
+        return best;
+    }
+}  // namespace
+
+int main(int argc, char *argv[]) {
+    gflags::SetUsageMessage(
+            "Finds the wrap point, breaks and holes of a legacy IF recording and indexes it. Usage: SiGeScan [flags] <recording_IF_<time>.bin>");
+    gflags::ParseCommandLineFlags(&argc, &argv, true);
+    if (argc != 2) {
+        gflags::ShowUsageWithFlags(argv[0]);
+        return 1;
+    }
+    const std::string input = argv[1];
+    const SiGeMode &mode = *FindSiGeMode(static_cast<unsigned>(FLAGS_devmode));
+    const size_t block_size = FLAGS_transfersize / mode.pack_mode;
+    const double rate = mode.sample_rate / mode.pack_mode;
+    if (block_size == 0) {
+        std::cerr << "--transfersize too small." << std::endl;
+        return 1;
+    }
+
+    int fd = open(input.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        std::cerr << "Couldn't open " << input << ": " << strerror(errno)
+                  << std::endl;
+        return 1;
+    }
+    const uint64_t size = static_cast<uint64_t>(st.st_size);
+    unsigned thread_count = FLAGS_threads;
+    if (thread_count == 0) {
+        thread_count = std::max(std::thread::hardware_concurrency(), 1u);
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    Scanner scanner(fd, size, mode, block_size, thread_count);
+    scanner.Scan();
+    const double threshold = scanner.Threshold();
+    std::vector<Break> breaks = scanner.Breaks(threshold);
+    const auto holes = scanner.Holes();
+    double seconds = std::chrono::duration<double>(
+            std::chrono::steady_clock::now() - start).count();
+    std::cerr << "Scanned " << size / 1e6 << " MB in " << seconds << " s ("
+              << size / 1e6 / seconds << " MB/s) with " << thread_count
+              << " threads." << std::endl;
+
+    std::string agc_path = FLAGS_agc;
+    if (agc_path.empty()) {
+        agc_path = FindAGCFile(input);
+        if (!agc_path.empty()) {
+            std::cerr << "Using AGC file " << agc_path << "." << std::endl;
+        }
+    }
+    uint32_t agc_first = 0;
+    uint32_t agc_last = 0;
+    uint64_t agc_samples = 0;
+    const bool has_agc = ReadAGCTimes(agc_path, &agc_first, &agc_last,
+                                      &agc_samples);
+    if (!has_agc) {
+        std::cerr << "No AGC data"
+                  << (agc_path.empty() ? " found" : " at " + agc_path)
+                  << ", no times and no length check; pass --agc."
+                  << std::endl;
+    }
+
+    // Where the last lap ended, if the file wrapped.
+    const bool could_wrap = size > FLAGS_circulargb * (1ull << 30);
+    bool wrapped = false;
+    uint64_t wrap = 0;
+    const char *wrap_source = "none";
+    double wrap_score = 0;
+    double expected_bytes = 0;
+    if (has_agc) {
+        expected_bytes = (agc_last - agc_first) * rate;
+        const double uncertainty = kAGCUncertaintySeconds * rate +
+                                   kClockUncertainty * expected_bytes;
+        wrapped = could_wrap && expected_bytes > size + uncertainty;
+        if (wrapped) {
+            const uint64_t estimate = static_cast<uint64_t>(
+                    std::fmod(expected_bytes, static_cast<double>(size)));
+            const uint64_t lo = estimate > uncertainty
+                                ? estimate - static_cast<uint64_t>(uncertainty)
+                                : 0;
+            const uint64_t hi = std::min<uint64_t>(
+                    size, estimate + static_cast<uint64_t>(uncertainty));
+            Break strongest = scanner.Strongest(lo, hi);
+            if (strongest.score >= threshold) {
+                wrap_source = "detected";
+            } else {
+                // Data lost on the way makes the AGC overestimate, look for
+                // the strongest break anywhere.
+                strongest = scanner.Strongest(0, size);
+                wrap_source = "detected-off-estimate";
+            }
+            if (strongest.score >= threshold) {
+                wrap = strongest.offset;
+                wrap_score = strongest.score;
+            } else {
+                wrap = estimate / block_size * block_size;
+                wrap_source = "estimated";
+            }
+        }
+    } else if (could_wrap) {
+        // No AGC to tell, only the strongest break in the whole file.
+        Break strongest = scanner.Strongest(0, size);
+        if (strongest.score >= threshold) {
+            wrapped = true;
+            wrap = strongest.offset;
+            wrap_score = strongest.score;
+            wrap_source = "detected-without-agc";
+        }
+    }
+
+    // The file's segments from the oldest data to the newest.
+    std::vector<std::pair<uint64_t, uint64_t>> segments;
+    if (wrapped && wrap > 0) {
+        segments.emplace_back(wrap, size);
+        segments.emplace_back(0, wrap);
+    } else {
+        segments.emplace_back(0, size);
+    }
+    // Unix time of the oldest byte: the recording's start if nothing was
+    // overwritten, else counted back from its end.
+    const double oldest_time = !has_agc ? 0
+                               : wrapped ? agc_last + 1 - size / rate
+                               : agc_first;
+
+    std::string output = FLAGS_output.empty() ? input + ".index"
+                                              : FLAGS_output;
+    std::ofstream index(output);
+    index << std::fixed << std::setprecision(3);
+    index << "# VISTA IF index v1" << std::endl
+          << "file " << input << " " << size << std::endl
+          << "devmode " << FLAGS_devmode << " rate " << rate << " block "
+          << block_size << std::endl;
+    if (has_agc) {
+        index << "agc " << agc_path << " " << agc_first << " " << agc_last
+              << " " << agc_samples << " expected_bytes "
+              << static_cast<uint64_t>(expected_bytes) << std::endl;
+    }
+    index << "wrap " << (wrapped ? "yes" : "no") << " " << wrap << " "
+          << wrap_source << " " << wrap_score << std::endl
+          << "threshold " << threshold << std::endl;
+    for (const auto &found : breaks) {
+        if (!(wrapped && found.offset == wrap)) {
+            index << "break " << found.offset << " " << found.score
+                  << std::endl;
+        }
+    }
+    for (const auto &hole : holes) {
+        index << "hole " << hole.first << " " << hole.second - hole.first
+              << std::endl;
+    }
+    uint64_t logical = 0;
+    for (size_t i = 0; i < segments.size(); ++i) {
+        index << "segment " << i << " " << segments[i].first << " "
+              << segments[i].second - segments[i].first << " "
+              << oldest_time + logical / rate << std::endl;
+        logical += segments[i].second - segments[i].first;
+    }
+    // Unix time to file offset, assuming no data was lost between breaks.
+    if (has_agc && FLAGS_seekseconds > 0) {
+        for (double t = std::ceil(oldest_time);
+             (t - oldest_time) * rate < size; t += FLAGS_seekseconds) {
+            uint64_t position = static_cast<uint64_t>(
+                    (t - oldest_time) * rate) / block_size * block_size;
+            for (const auto &segment : segments) {
+                uint64_t length = segment.second - segment.first;
+                if (position < length) {
+                    index << "seek " << static_cast<uint64_t>(t) << " "
+                          << segment.first + position << std::endl;
+                    break;
+                }
+                position -= length;
+            }
+        }
+    }
+    if (!index.good()) {
+        std::cerr << "Couldn't write " << output << "." << std::endl;
+        return 1;
+    }
+
+    std::cerr << "Wrap: " << (wrapped ? "yes" : "no");
+    if (wrapped) {
+        std::cerr << " at " << wrap << " (" << wrap_source << ")";
+    }
+    std::cerr << ", " << breaks.size() << " breaks, " << holes.size()
+              << " holes." << std::endl;
+    if (has_agc && !wrapped) {
+        std::cerr << "AGC covers " << agc_last - agc_first << " s, "
+                  << static_cast<uint64_t>(expected_bytes) << " bytes, the "
+                  << "file has " << size << "." << std::endl;
+    }
+    std::cerr << "Index written to " << output << "." << std::endl;
+    return 0;
+}
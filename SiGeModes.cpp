@@ -0,0 +1,36 @@
+#include "SiGeModes.h"
+
+namespace {
+    // Modes 1, 3, 5, 7 have an IF of 4.1304e6.
+    // Modes 2, 4, 6, 8 have an IF of 4.092e6.
+    // Lower four modes are wideband. Upper narrowband.
+    const SiGeMode kModes[] = {
+            {1, 32, 16367600, 4.1304e6, false, 4},
+            {2, 36, 8183800, 4.092e6, true, 2},
+            {3, 38, 5455867, 4.1304e6, false, 4},
+            {4, 42, 4091900, 4.092e6, true, 2},
+            {5, 132, 16367600, 4.1304e6, false, 4},
+            {6, 136, 8183800, 4.092e6, true, 2},
+            {7, 138, 5455867, 4.1304e6, false, 4},
+            {8, 142, 4091900, 4.092e6, true, 2},
+    };
+    // freqagc_ = 97.5;
+}  // namespace
+
+const SiGeMode *FindSiGeMode(unsigned devmode) {
+    for (const auto &mode : kModes) {
+        if (mode.devmode == devmode) {
+            return &mode;
+        }
+    }
+    return nullptr;
+}
+
+const SiGeMode *FindSiGeModeByFirmwareMode(unsigned char fw_mode) {
+    for (const auto &mode : kModes) {
+        if (mode.fw_mode == fw_mode) {
+            return &mode;
+        }
+    }
+    return nullptr;
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+#include <cstdint>
+
+// Frontend settings behind each --devmode (please refer to
+// http://ccar.colorado.edu/gnss).
+struct SiGeMode {
+    unsigned char devmode;
+    // Value sent with kOutVendorDeviceRequestCMode.
+    unsigned char fw_mode;
+    // Samples per second; complex samples for complex modes. The USB stream
+    // carries one byte per sample.
+    double sample_rate;
+    double if_frequency;
+    bool is_complex;
+    // Samples packed into one byte of recorded IF data.
+    unsigned char pack_mode;
+};
+
+// Returns nullptr for an unknown devmode.
+const SiGeMode *FindSiGeMode(unsigned devmode);
+
+// Returns nullptr for an unknown firmware mode.
+const SiGeMode *FindSiGeModeByFirmwareMode(unsigned char fw_mode);
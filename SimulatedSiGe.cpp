@@ -0,0 +1,426 @@
+#include "SimulatedSiGe.h"
+#include "SiGeModes.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <poll.h>
+#include <random>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+namespace {
+    // Requests and indices the model answers, as sent by AGCMonitor.
+    constexpr uint8_t kInVendorDeviceRequestStatus = 0x80;
+    constexpr uint8_t kInVendorDeviceRequestAGC = 0x88;
+    constexpr uint8_t kInVendorDeviceRequestFlags = 0x90;
+    constexpr uint8_t kOutVendorDeviceRequestINTransfer = 0x01;
+    constexpr uint8_t kOutVendorDeviceRequestCMode = 0x0F;
+    constexpr uint16_t GS_kControlTransferIndexIsRXOverrun = 0x0001;
+
+    constexpr double kAGCRate = 97.5;
+    constexpr unsigned kAGCBufferSamples = 32;
+    // How often the device thread moves data, the model's time resolution.
+    constexpr auto kDeviceTick = std::chrono::microseconds(500);
+    constexpr size_t kNoiseSize = 1 << 20;
+
+    libusb_device_handle simulated_handle = {nullptr};
+}  // namespace
+
+SimulatedSiGe &SimulatedSiGe::Instance() {
+    static SimulatedSiGe instance;
+    return instance;
+}
+
+SimulatedSiGe::SimulatedSiGe()
+        : config_{4096, 0, 0},
+          event_fd_(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)),
+          is_open_(false), is_streaming_(false),
+          is_interrupted_(false), sample_rate_(0), fifo_level_(0),
+          agc_level_(0), front_filled_(0), noise_(kNoiseSize), noise_offset_(0), stats_() {
+    // Random 2-bit I and Q samples, so that the pipeline has something
+    // realistic to pack and look at.
+    std::mt19937 generator(1);
+    for (auto &byte : noise_) {
+        byte = static_cast<uint8_t>(generator() & 0x0F);
+    }
+}
+
+void SimulatedSiGe::Configure(const Config &config) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    config_ = config;
+}
+
+SimulatedSiGe::Stats SimulatedSiGe::GetStats() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return stats_;
+}
+
+void SimulatedSiGe::Open() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (is_open_) {
+        return;
+    }
+    is_open_ = true;
+    is_streaming_ = false;
+    sample_rate_ = 0;
+    fifo_level_ = 0;
+    agc_level_ = 0;
+    pending_.clear();
+    completed_.clear();
+    front_filled_ = 0;
+    stats_ = Stats();
+    stats_.min_pending_transfers = SIZE_MAX;
+    device_thread_ = std::thread(&SimulatedSiGe::DeviceThread, this);
+}
+
+void SimulatedSiGe::Close() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!is_open_) {
+            return;
+        }
+        is_open_ = false;
+        is_streaming_ = false;
+        // Transfers still queued are dropped, the way a reset device drops
+        // them.
+        pending_.clear();
+        completed_.clear();
+    }
+    completed_condition_.notify_all();
+    device_thread_.join();
+}
+
+int SimulatedSiGe::Submit(libusb_transfer *transfer) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!is_open_) {
+        return LIBUSB_ERROR_NO_DEVICE;
+    }
+    pending_.push_back(transfer);
+    return LIBUSB_SUCCESS;
+}
+
+int SimulatedSiGe::Cancel(libusb_transfer *transfer) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = std::find(pending_.begin(), pending_.end(), transfer);
+    if (it == pending_.end()) {
+        return LIBUSB_ERROR_NOT_FOUND;
+    }
+    // Like the real thing, the oldest transfer keeps what it got so far.
+    transfer->actual_length = 0;
+    if (it == pending_.begin()) {
+        transfer->actual_length = static_cast<int>(front_filled_);
+        front_filled_ = 0;
+    }
+    pending_.erase(it);
+    transfer->status = LIBUSB_TRANSFER_CANCELLED;
+    completed_.push_back(transfer);
+    NotifyCompleted();
+    return LIBUSB_SUCCESS;
+}
+
+int SimulatedSiGe::ControlTransfer(uint8_t request, uint16_t value,
+                                   uint16_t index, unsigned char *data,
+                                   uint16_t length) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!is_open_) {
+        return LIBUSB_ERROR_NO_DEVICE;
+    }
+    switch (request) {
+        case kInVendorDeviceRequestStatus:
+            if (length > 0) {
+                data[0] = index == GS_kControlTransferIndexIsRXOverrun &&
+                          stats_.overrun;
+            }
+            return std::min<int>(length, 1);
+        case kInVendorDeviceRequestFlags:
+            memset(data, 0, length);
+            if (length > 2) {
+                data[2] = static_cast<unsigned char>(
+                        std::min<double>(agc_level_, kAGCBufferSamples));
+            }
+            return length;
+        case kInVendorDeviceRequestAGC: {
+            // Samples are 12 bits, little endian, never 0.
+            for (unsigned i = 0; i + 1 < length; i += 2) {
+                uint16_t sample = static_cast<uint16_t>(
+                        0x700 + noise_[(noise_offset_ + i) % kNoiseSize]);
+                data[i] = static_cast<unsigned char>(sample & 0xFF);
+                data[i + 1] = static_cast<unsigned char>(sample >> 8);
+            }
+            agc_level_ = 0;
+            return length;
+        }
+        case kOutVendorDeviceRequestCMode: {
+            const SiGeMode *mode = FindSiGeModeByFirmwareMode(
+                    static_cast<unsigned char>(value));
+            sample_rate_ = mode != nullptr ? mode->sample_rate : 0;
+            return 0;
+        }
+        case kOutVendorDeviceRequestINTransfer:
+            if (value && !is_streaming_) {
+                streaming_start_ = std::chrono::steady_clock::now();
+                next_stall_ = streaming_start_ + std::chrono::duration_cast<
+                        std::chrono::steady_clock::duration>(
+                        std::chrono::duration<double>(config_.stall_every));
+            }
+            is_streaming_ = value != 0;
+            return 0;
+        default:
+            // Everything else only matters to the real frontend.
+            return (request & 0x80) ? length : 0;
+    }
+}
+
+int SimulatedSiGe::HandleEvents(timeval *tv) {
+    std::deque<libusb_transfer *> completed;
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        auto timeout = std::chrono::seconds(tv->tv_sec) +
+                       std::chrono::microseconds(tv->tv_usec);
+        completed_condition_.wait_for(lock, timeout, [this] {
+            return !completed_.empty() || !is_open_ || is_interrupted_;
+        });
+        is_interrupted_ = false;
+        // Whatever completes from here on signals again.
+        uint64_t count;
+        while (read(event_fd_, &count, sizeof(count)) > 0) {
+        }
+
+        auto now = std::chrono::steady_clock::now();
+        if (is_streaming_ && config_.stall_ms > 0 &&
+            config_.stall_every > 0 && now >= next_stall_) {
+            next_stall_ = now + std::chrono::duration_cast<
+                    std::chrono::steady_clock::duration>(
+                    std::chrono::duration<double>(config_.stall_every));
+            ++stats_.stalls;
+            lock.unlock();
+            std::this_thread::sleep_for(
+                    std::chrono::milliseconds(config_.stall_ms));
+            lock.lock();
+        }
+        completed.swap(completed_);
+    }
+    // Callbacks resubmit, so they run without the lock, like libusb's.
+    for (auto transfer : completed) {
+        transfer->callback(transfer);
+    }
+    return LIBUSB_SUCCESS;
+}
+
+int SimulatedSiGe::EventFd() const {
+    return event_fd_;
+}
+
+void SimulatedSiGe::InterruptEvents() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    is_interrupted_ = true;
+    completed_condition_.notify_all();
+}
+
+void SimulatedSiGe::DeviceThread() {
+    auto last = std::chrono::steady_clock::now();
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (is_open_) {
+        lock.unlock();
+        std::this_thread::sleep_for(kDeviceTick);
+        lock.lock();
+
+        // The hardware doesn't stop when this thread isn't scheduled, so
+        // whatever time went by is accounted for in one go.
+        auto now = std::chrono::steady_clock::now();
+        double elapsed = std::chrono::duration<double>(now - last).count();
+        last = now;
+        agc_level_ += elapsed * kAGCRate;
+        if (!is_streaming_ || sample_rate_ == 0) {
+            continue;
+        }
+        fifo_level_ += elapsed * sample_rate_;
+        stats_.min_pending_transfers = std::min(stats_.min_pending_transfers,
+                                                pending_.size());
+        FillTransfers();
+        if (fifo_level_ > config_.fifo_bytes) {
+            if (!stats_.overrun) {
+                stats_.overrun = true;
+                stats_.overrun_after = std::chrono::duration<double>(
+                        now - streaming_start_).count();
+            }
+            fifo_level_ = config_.fifo_bytes;  // The rest is lost.
+        }
+        stats_.max_fifo_level = std::max(stats_.max_fifo_level,
+                                         static_cast<size_t>(fifo_level_));
+    }
+}
+
+void SimulatedSiGe::FillTransfers() {
+    bool any_completed = false;
+    // The FIFO drains into the oldest pending transfer packet by packet, so
+    // a transfer fills up gradually and the FIFO only grows when no transfer
+    // is pending at all.
+    while (!pending_.empty() && fifo_level_ >= 1) {
+        libusb_transfer *transfer = pending_.front();
+        const size_t length = static_cast<size_t>(transfer->length);
+        size_t chunk = std::min(length - front_filled_,
+                                static_cast<size_t>(fifo_level_));
+        for (size_t done = 0; done < chunk;) {
+            size_t part = std::min(chunk - done, kNoiseSize - noise_offset_);
+            memcpy(transfer->buffer + front_filled_ + done,
+                   noise_.data() + noise_offset_, part);
+            done += part;
+            noise_offset_ = (noise_offset_ + part) % kNoiseSize;
+        }
+        front_filled_ += chunk;
+        fifo_level_ -= chunk;
+        if (front_filled_ < length) {
+            break;
+        }
+        pending_.pop_front();
+        front_filled_ = 0;
+        transfer->status = LIBUSB_TRANSFER_COMPLETED;
+        transfer->actual_length = transfer->length;
+        completed_.push_back(transfer);
+        ++stats_.completed_transfers;
+        any_completed = true;
+    }
+    if (any_completed) {
+        NotifyCompleted();
+    }
+}
+
+void SimulatedSiGe::NotifyCompleted() {
+    completed_condition_.notify_all();
+    // Only fails once the counter is huge, when it is readable anyway.
+    const uint64_t one = 1;
+    ssize_t written = write(event_fd_, &one, sizeof(one));
+    (void) written;
+}
+
+// libusb API, as far as AGCMonitor uses it.
+
+namespace {
+    // libusb_strerror took an enum libusb_error before libusb 1.0.22 and an
+    // int since; take whichever the installed header declares.
+    template<typename T>
+    struct FirstArgument;
+
+    template<typename R, typename A>
+    struct FirstArgument<R (*)(A)> {
+        using type = A;
+    };
+}  // namespace
+
+extern "C" {
+
+int libusb_init(libusb_context **ctx) {
+    if (ctx != nullptr) {
+        *ctx = nullptr;
+    }
+    return LIBUSB_SUCCESS;
+}
+
+void libusb_exit(libusb_context *) {}
+
+const char *libusb_strerror(
+        FirstArgument<decltype(&libusb_strerror)>::type errcode) {
+    switch (static_cast<int>(errcode)) {
+        case LIBUSB_SUCCESS:
+            return "Success (simulated)";
+        case LIBUSB_ERROR_NO_DEVICE:
+            return "No such device (simulated)";
+        case LIBUSB_ERROR_NOT_FOUND:
+            return "Entity not found (simulated)";
+        default:
+            return "Other error (simulated)";
+    }
+}
+
+libusb_device_handle *libusb_open_device_with_vid_pid(libusb_context *,
+                                                      uint16_t, uint16_t) {
+    simulated_handle.device = &SimulatedSiGe::Instance();
+    simulated_handle.device->Open();
+    return &simulated_handle;
+}
+
+void libusb_close(libusb_device_handle *dev_handle) {
+    dev_handle->device->Close();
+}
+
+int libusb_set_configuration(libusb_device_handle *, int) {
+    return LIBUSB_SUCCESS;
+}
+
+int libusb_claim_interface(libusb_device_handle *, int) {
+    return LIBUSB_SUCCESS;
+}
+
+int libusb_release_interface(libusb_device_handle *, int) {
+    return LIBUSB_SUCCESS;
+}
+
+int libusb_set_interface_alt_setting(libusb_device_handle *, int, int) {
+    return LIBUSB_SUCCESS;
+}
+
+int libusb_reset_device(libusb_device_handle *) {
+    return LIBUSB_SUCCESS;
+}
+
+libusb_transfer *libusb_alloc_transfer(int iso_packets) {
+    size_t size = sizeof(libusb_transfer) +
+                  iso_packets * sizeof(libusb_iso_packet_descriptor);
+    auto transfer = static_cast<libusb_transfer *>(calloc(1, size));
+    if (transfer != nullptr) {
+        transfer->num_iso_packets = iso_packets;
+    }
+    return transfer;
+}
+
+void libusb_free_transfer(libusb_transfer *transfer) {
+    free(transfer);
+}
+
+int libusb_submit_transfer(libusb_transfer *transfer) {
+    return transfer->dev_handle->device->Submit(transfer);
+}
+
+int libusb_cancel_transfer(libusb_transfer *transfer) {
+    return transfer->dev_handle->device->Cancel(transfer);
+}
+
+int libusb_control_transfer(libusb_device_handle *dev_handle, uint8_t,
+                            uint8_t bRequest, uint16_t wValue, uint16_t wIndex,
+                            unsigned char *data, uint16_t wLength,
+                            unsigned int) {
+    return dev_handle->device->ControlTransfer(bRequest, wValue, wIndex, data,
+                                               wLength);
+}
+
+int libusb_handle_events_timeout_completed(libusb_context *, timeval *tv,
+                                           int *) {
+    return SimulatedSiGe::Instance().HandleEvents(tv);
+}
+
+void libusb_interrupt_event_handler(libusb_context *) {
+    SimulatedSiGe::Instance().InterruptEvents();
+}
+
+// The model's eventfd, see the class comment.
+const libusb_pollfd **libusb_get_pollfds(libusb_context *) {
+    static libusb_pollfd pollfd;
+    static const libusb_pollfd *pollfds[2] = {&pollfd, nullptr};
+    pollfd.fd = SimulatedSiGe::Instance().EventFd();
+    pollfd.events = POLLIN;
+    return pollfds;
+}
+
+// libusb_get_pollfds hands out static storage.
+void libusb_free_pollfds(const libusb_pollfd **) {}
+
+void libusb_set_pollfd_notifiers(libusb_context *, libusb_pollfd_added_cb,
+                                 libusb_pollfd_removed_cb, void *) {}
+
+int libusb_pollfds_handle_timeouts(libusb_context *) {
+    return 1;
+}
+
+}  // extern "C"
@@ -0,0 +1,117 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <libusb-1.0/libusb.h>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A software model of the SiGe module, behind the subset of the libusb API
+// that AGCMonitor uses. SimulatedSiGe.cpp defines those libusb functions, so
+// linking it instead of libusb-1.0 runs the real AGCMonitor pipeline against
+// the model; this is what SiGeSoak does.
+//
+// The model streams one byte per sample at the rate of the firmware mode set
+// with kOutVendorDeviceRequestCMode, once kOutVendorDeviceRequestINTransfer
+// turned streaming on. Samples go to a finite on-chip FIFO, which drains into
+// the oldest submitted IF transfer; once full, the transfer is completed and
+// handed to its callback by the next libusb_handle_events_timeout_completed
+// call. If the FIFO overflows because no transfer was submitted in time, the
+// RX-overrun status is latched, exactly what
+// GetStatus(GS_kControlTransferIndexIsRXOverrun) reads from the module.
+// AGC samples accumulate at about 97.5 Hz in a 32 sample buffer. Completed
+// transfers are signalled on an eventfd, the one file descriptor
+// libusb_get_pollfds returns, so the events can be handled by a Reactor as
+// well as by a thread calling libusb_handle_events_timeout_completed.
+class SimulatedSiGe {
+
+public:
+    struct Config {
+        // Size of the on-chip FIFO in bytes.
+        size_t fifo_bytes;
+        // Every stall_every seconds, the USB event handling thread is held
+        // for stall_ms milliseconds before running callbacks, as if the
+        // scheduler didn't run it.
+        unsigned stall_ms;
+        double stall_every;
+    };
+
+    struct Stats {
+        bool overrun;
+        // Seconds from the start of streaming to the overrun.
+        double overrun_after;
+        // Largest FIFO fill level seen, in bytes.
+        size_t max_fifo_level;
+        // Fewest transfers submitted and not yet filled, while streaming.
+        size_t min_pending_transfers;
+        uint64_t completed_transfers;
+        uint64_t stalls;
+    };
+
+    static SimulatedSiGe &Instance();
+
+    void Configure(const Config &config);
+
+    Stats GetStats();
+
+    // libusb entry points.
+    void Open();
+
+    void Close();
+
+    int Submit(libusb_transfer *transfer);
+
+    int Cancel(libusb_transfer *transfer);
+
+    int ControlTransfer(uint8_t request, uint16_t value, uint16_t index,
+                        unsigned char *data, uint16_t length);
+
+    int HandleEvents(timeval *tv);
+
+    // Makes a waiting HandleEvents return.
+    void InterruptEvents();
+
+    // Readable while completed transfers wait for HandleEvents.
+    int EventFd() const;
+
+private:
+    SimulatedSiGe();
+
+    void DeviceThread();
+
+    // Moves as many FIFO bytes as possible into pending transfers. Must be
+    // called with mutex_ held.
+    void FillTransfers();
+
+    // Wakes whoever handles the events up. Must be called with mutex_ held.
+    void NotifyCompleted();
+
+    Config config_;
+    std::mutex mutex_;
+    std::condition_variable completed_condition_;
+    int event_fd_;
+    std::thread device_thread_;
+    bool is_open_;
+    bool is_streaming_;
+    bool is_interrupted_;
+    double sample_rate_;
+    double fifo_level_;
+    double agc_level_;
+    // Bytes already in the oldest pending transfer.
+    size_t front_filled_;
+    std::deque<libusb_transfer *> pending_;
+    std::deque<libusb_transfer *> completed_;
+    std::vector<uint8_t> noise_;
+    size_t noise_offset_;
+    std::chrono::steady_clock::time_point streaming_start_;
+    std::chrono::steady_clock::time_point next_stall_;
+    Stats stats_;
+};
+
+// The libusb device handle of the model, opaque to AGCMonitor.
+struct libusb_device_handle {
+    SimulatedSiGe *device;
+};
@@ -0,0 +1,469 @@
+// SiGeSoak runs the real AGCMonitor pipeline against SimulatedSiGe under
+// configurable stress, to find how many IF transfers (and of what size) are
+// needed to survive it without an RX overrun.
+//
+// For each stress profile and each transfer buffer size, transfer depths are
+// tried from the smallest up, each for --seconds; the first depth that runs
+// without AGCMonitor raising SIGTERM (overrun or lost AGC samples) is the
+// minimum safe depth for that profile. Every run reports the overrun margin
+// (how much of the device FIFO stayed free), the fewest transfers left
+// queued at the device, and the process CPU time and context switches.
+//
+// Every combination is run with each pipeline topology in --topologies:
+// threaded (the packing thread between two queues) and fused (--fused), to
+// compare their CPU use and context switch rates, and fused+socket, fused
+// with a subscriber on --ifsocket that must stay connected through the run.
+// These handle the USB events on AsyncUSBThread; reactor and fused+reactor
+// handle them on a Reactor instead, woken by the model's eventfd, which is
+// what the recorder does in flight.
+
+#include "AGCMonitor.h"
+#include "Reactor.h"
+#include "SimulatedSiGe.h"
+
+#include <atomic>
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <gflags/gflags.h>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <poll.h>
+#include <sstream>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+DECLARE_bool(fused);
+DECLARE_string(ifsocket);
+
+DEFINE_int32(devmode, 1, "Mode to simulate, 1 and 5 have the highest rate.");
+DEFINE_string(logname, "/tmp/sige_soak",
+              "Prefix of the files the pipeline records during the runs.");
+DEFINE_bool(keepfiles, false, "Keeps the recorded files of each run.");
+DEFINE_uint32(seconds, 60, "Duration of each run.");
+DEFINE_string(profiles, "baseline,stall,contention,storage,all",
+              "Comma separated stress profiles to run: baseline, stall, contention, storage or all (the three together).");
+DEFINE_string(depths, "16,32,64,128,256,512,768",
+              "Comma separated transfer depths to try, from the smallest.");
+DEFINE_string(sizes, "16384",
+              "Comma separated transfer buffer sizes to try, multiples of 512.");
+DEFINE_string(topologies, "threaded,fused,fused+socket,reactor,fused+reactor",
+              "Comma separated pipeline topologies to run: threaded, fused, fused+socket, reactor (threaded, with the USB events handled by a Reactor as in flight), fused+reactor.");
+DEFINE_uint64(fifobytes, 4096, "Size of the simulated on-chip FIFO.");
+DEFINE_uint32(stallms, 100,
+              "Stall profile: how long the USB event thread is held.");
+DEFINE_double(stallevery, 5, "Stall profile: seconds between stalls.");
+DEFINE_uint32(cputhreads, 2,
+              "Contention profile: number of busy threads competing for the CPU.");
+DEFINE_uint32(storagemb, 64,
+              "Storage profile: megabytes written and synced next to the recording per burst.");
+DEFINE_double(storageevery, 10, "Storage profile: seconds between bursts.");
+
+namespace {
+    volatile sig_atomic_t terminate_caught = 0;
+    volatile sig_atomic_t interrupt_caught = 0;
+
+    void SIG_handler(int signum) {
+        if (signum == SIGTERM) {
+            terminate_caught = 1;  // AGCMonitor gave up.
+        } else if (signum == SIGINT) {
+            interrupt_caught = 1;  // The user did.
+        }
+    }
+
+    std::vector<unsigned> ParseList(const std::string &list) {
+        std::vector<unsigned> values;
+        std::stringstream ss(list);
+        std::string item;
+        while (std::getline(ss, item, ',')) {
+            values.push_back(static_cast<unsigned>(std::stoul(item)));
+        }
+        return values;
+    }
+
+    std::vector<std::string> SplitList(const std::string &list) {
+        std::vector<std::string> items;
+        std::stringstream ss(list);
+        std::string item;
+        while (std::getline(ss, item, ',')) {
+            items.push_back(item);
+        }
+        return items;
+    }
+
+    struct Profile {
+        bool stall;
+        bool contention;
+        bool storage;
+    };
+
+    bool FindProfile(const std::string &name, Profile *profile) {
+        *profile = {name == "stall" || name == "all",
+                    name == "contention" || name == "all",
+                    name == "storage" || name == "all"};
+        return name == "baseline" || name == "stall" || name == "contention" ||
+               name == "storage" || name == "all";
+    }
+
+    struct RunResult {
+        bool survived;
+        // Fused+socket: the subscriber lost its connection during the run.
+        bool subscriber_dropped;
+        SimulatedSiGe::Stats stats;
+        double cpu_seconds;
+        long context_switches;
+        double seconds;
+    };
+
+    // Background load for the contention and storage profiles.
+    class Stressor {
+    public:
+        Stressor(const Profile &profile, const std::string &directory)
+                : stop_(false) {
+            if (profile.contention) {
+                for (unsigned i = 0; i < FLAGS_cputhreads; ++i) {
+                    threads_.emplace_back([this] {
+                        volatile uint64_t x = 0;
+                        while (!stop_) {
+                            ++x;
+                        }
+                    });
+                }
+            }
+            if (profile.storage) {
+                threads_.emplace_back(&Stressor::StorageThread, this,
+                                      directory + "/sige_soak_storage.tmp");
+            }
+        }
+
+        ~Stressor() {
+            stop_ = true;
+            for (auto &thread : threads_) {
+                thread.join();
+            }
+        }
+
+    private:
+        // Dirty a lot of pages and force them out, competing with the
+        // recording for the device and for writeback.
+        void StorageThread(const std::string &path) {
+            std::vector<char> junk(1 << 20, 0x55);
+            while (!stop_) {
+                int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC,
+                              0644);
+                if (fd >= 0) {
+                    for (unsigned i = 0; i < FLAGS_storagemb && !stop_; ++i) {
+                        if (write(fd, junk.data(), junk.size()) < 0) {
+                            break;
+                        }
+                    }
+                    fsync(fd);
+                    close(fd);
+                    unlink(path.c_str());
+                }
+                for (double waited = 0;
+                     waited < FLAGS_storageevery && !stop_; waited += 0.1) {
+                    std::this_thread::sleep_for(
+                            std::chrono::milliseconds(100));
+                }
+            }
+        }
+
+        std::atomic<bool> stop_;
+        std::vector<std::thread> threads_;
+    };
+
+    // Reads everything the IF socket sends, as a live consumer would.
+    class SocketSubscriber {
+    public:
+        explicit SocketSubscriber(const std::string &path)
+                : stop_(false), connected_(false), dropped_(false),
+                  thread_(&SocketSubscriber::ReadThread, this, path) {}
+
+        ~SocketSubscriber() {
+            Stop();
+        }
+
+        void Stop() {
+            stop_ = true;
+            if (thread_.joinable()) {
+                thread_.join();
+            }
+        }
+
+        // Never connected, or disconnected by the recorder.
+        bool Dropped() const {
+            return !connected_ || dropped_;
+        }
+
+    private:
+        void ReadThread(const std::string &path) {
+            sockaddr_un address = {};
+            address.sun_family = AF_UNIX;
+            strncpy(address.sun_path, path.c_str(),
+                    sizeof(address.sun_path) - 1);
+            int fd = -1;
+            // The sink is created once the writer thread runs.
+            while (!stop_ && !connected_) {
+                fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+                if (connect(fd, reinterpret_cast<sockaddr *>(&address),
+                            sizeof(address)) == 0) {
+                    connected_ = true;
+                } else {
+                    close(fd);
+                    fd = -1;
+                    std::this_thread::sleep_for(
+                            std::chrono::milliseconds(10));
+                }
+            }
+            std::vector<uint8_t> message(1 << 20);
+            while (!stop_ && fd >= 0) {
+                pollfd pfd = {fd, POLLIN, 0};
+                if (poll(&pfd, 1, 100 /* ms */) <= 0) {
+                    continue;
+                }
+                if (recv(fd, message.data(), message.size(), 0) <= 0) {
+                    dropped_ = true;
+                    break;
+                }
+            }
+            if (fd >= 0) {
+                close(fd);
+            }
+        }
+
+        std::atomic<bool> stop_;
+        std::atomic<bool> connected_;
+        std::atomic<bool> dropped_;
+        std::thread thread_;
+    };
+
+    void RemoveRecordings(const std::string &logname) {
+        std::string directory = ".";
+        std::string prefix = logname;
+        auto slash = logname.rfind('/');
+        if (slash != std::string::npos) {
+            directory = slash == 0 ? "/" : logname.substr(0, slash);
+            prefix = logname.substr(slash + 1);
+        }
+        DIR *dir = opendir(directory.c_str());
+        if (dir == nullptr) {
+            return;
+        }
+        while (dirent *entry = readdir(dir)) {
+            std::string name = entry->d_name;
+            if (name.compare(0, prefix.size() + 4, prefix + "_IF_") == 0 ||
+                name.compare(0, prefix.size() + 5, prefix + "_AGC_") == 0 ||
+                name.compare(0, prefix.size() + 7, prefix + "_TRACE_") == 0) {
+                unlink((directory + "/" + name).c_str());
+            }
+        }
+        closedir(dir);
+    }
+
+    RunResult Run(const Profile &profile, unsigned depth, unsigned size,
+                  bool subscribe, bool use_reactor) {
+        SimulatedSiGe::Config config;
+        config.fifo_bytes = FLAGS_fifobytes;
+        config.stall_ms = profile.stall ? FLAGS_stallms : 0;
+        config.stall_every = FLAGS_stallevery;
+        SimulatedSiGe::Instance().Configure(config);
+
+        std::string directory = FLAGS_logname.substr(
+                0, FLAGS_logname.rfind('/') + 1);
+        Stressor stressor(profile, directory.empty() ? "." : directory);
+
+        terminate_caught = 0;
+        bool subscriber_dropped = false;
+        SimulatedSiGe::Stats stats;
+        rusage usage_start;
+        getrusage(RUSAGE_SELF, &usage_start);
+        auto start = std::chrono::steady_clock::now();
+        {
+            // Outlives the monitor, which unwatches the USB events on stop.
+            Reactor reactor;
+            AGCMonitor monitor;
+            monitor.SetMode(static_cast<unsigned char>(FLAGS_devmode));
+            monitor.SetTransfers(depth, size);
+            monitor.SetLogName(FLAGS_logname);
+            if (use_reactor) {
+                monitor.SetReactor(&reactor);
+            }
+            monitor.OpenDevice();
+            monitor.StartRecording();
+            std::unique_ptr<SocketSubscriber> subscriber;
+            if (subscribe) {
+                subscriber.reset(new SocketSubscriber(FLAGS_ifsocket));
+            }
+            auto is_done = [start] {
+                return terminate_caught || interrupt_caught ||
+                       std::chrono::steady_clock::now() - start >=
+                       std::chrono::seconds(FLAGS_seconds);
+            };
+            if (use_reactor) {
+                reactor.AddTimer(0.05, true /* periodic */,
+                                 [&reactor, &is_done] {
+                                     if (is_done()) {
+                                         reactor.Stop();
+                                     }
+                                 });
+                reactor.Run();
+            } else {
+                while (!is_done()) {
+                    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+                }
+            }
+            // Once stopped, nobody resubmits and the model overruns for sure.
+            stats = SimulatedSiGe::Instance().GetStats();
+            if (subscriber) {
+                // Before the sink closes the connection on its own.
+                subscriber->Stop();
+                subscriber_dropped = subscriber->Dropped();
+            }
+            monitor.StopRecording();
+            monitor.CloseDevice();
+        }
+        auto end = std::chrono::steady_clock::now();
+        rusage usage_end;
+        getrusage(RUSAGE_SELF, &usage_end);
+
+        if (!FLAGS_keepfiles) {
+            RemoveRecordings(FLAGS_logname);
+        }
+
+        RunResult result;
+        result.subscriber_dropped = subscriber_dropped;
+        result.survived = !terminate_caught && !interrupt_caught &&
+                          !subscriber_dropped;
+        result.stats = stats;
+        auto seconds = [](const timeval &tv) {
+            return tv.tv_sec + tv.tv_usec * 1e-6;
+        };
+        result.cpu_seconds = seconds(usage_end.ru_utime) -
+                             seconds(usage_start.ru_utime) +
+                             seconds(usage_end.ru_stime) -
+                             seconds(usage_start.ru_stime);
+        result.context_switches = usage_end.ru_nvcsw - usage_start.ru_nvcsw +
+                                  usage_end.ru_nivcsw - usage_start.ru_nivcsw;
+        result.seconds = std::chrono::duration<double>(end - start).count();
+        return result;
+    }
+}  // namespace
+
+int main(int argc, char *argv[]) {
+    gflags::SetUsageMessage(
+            "Finds the minimum IF transfer depth surviving each stress profile, against a simulated SiGe module.");
+    gflags::ParseCommandLineFlags(&argc, &argv, true);
+
+    signal(SIGINT, SIG_handler);
+    signal(SIGTERM, SIG_handler);
+    signal(SIGPIPE, SIG_IGN);
+
+    auto depths = ParseList(FLAGS_depths);
+    auto sizes = ParseList(FLAGS_sizes);
+    for (auto size : sizes) {
+        if (size == 0 || size % 512 != 0) {
+            std::cerr << "Invalid transfer size " << size
+                      << ", must be a multiple of 512." << std::endl;
+            return 1;
+        }
+    }
+
+    std::ostringstream summary;
+    auto topologies = SplitList(FLAGS_topologies);
+    for (const auto &topology : topologies) {
+        if (topology != "threaded" && topology != "fused" &&
+            topology != "fused+socket" && topology != "reactor" &&
+            topology != "fused+reactor") {
+            std::cerr << "Unknown topology " << topology << "." << std::endl;
+            return 1;
+        }
+    }
+
+    std::cout << "profile   topology         size  depth  memory   result          "
+                 "margin  min-queued  cpu%   ctxsw/s" << std::endl;
+    for (const auto &name : SplitList(FLAGS_profiles)) {
+        Profile profile;
+        if (!FindProfile(name, &profile)) {
+            std::cerr << "Unknown profile " << name << "." << std::endl;
+            return 1;
+        }
+        for (const auto &topology : topologies) {
+            FLAGS_fused = topology.compare(0, 5, "fused") == 0;
+            const bool use_reactor =
+                    topology.find("reactor") != std::string::npos;
+            FLAGS_ifsocket = topology == "fused+socket"
+                             ? FLAGS_logname + "_IF.sock" : "";
+            for (auto size : sizes) {
+                bool found = false;
+                for (auto depth : depths) {
+                    RunResult result = Run(profile, depth, size,
+                                           !FLAGS_ifsocket.empty(),
+                                           use_reactor);
+                    if (interrupt_caught) {
+                        std::cout << summary.str();
+                        return 1;
+                    }
+                    std::ostringstream outcome;
+                    if (result.survived) {
+                        outcome << "ok";
+                    } else if (result.subscriber_dropped) {
+                        outcome << "socket-dropped";
+                    } else if (result.stats.overrun) {
+                        outcome << "overrun@" << std::fixed
+                                << std::setprecision(1)
+                                << result.stats.overrun_after << "s";
+                    } else {
+                        outcome << "failed";
+                    }
+                    double margin = 100.0 * (1.0 -
+                                             static_cast<double>(
+                                                     result.stats.max_fifo_level) /
+                                             FLAGS_fifobytes);
+                    std::cout << std::left << std::setw(10) << name
+                              << std::setw(15) << topology << std::right
+                              << std::setw(6) << size << std::setw(7) << depth
+                              << std::setw(7) << depth * size / 1024 << "KB   "
+                              << std::left << std::setw(16) << outcome.str()
+                              << std::right << std::fixed
+                              << std::setprecision(1) << std::setw(5) << margin
+                              << "%" << std::setw(12)
+                              << (result.stats.min_pending_transfers == SIZE_MAX
+                                  ? 0 : result.stats.min_pending_transfers)
+                              << std::setw(6)
+                              << 100 * result.cpu_seconds / result.seconds
+                              << std::setw(10) << std::setprecision(0)
+                              << result.context_switches / result.seconds
+                              << std::endl;
+                    if (result.survived) {
+                        summary << name << " (" << topology
+                                << "): minimum depth " << depth << " x "
+                                << size << " bytes (" << depth * size / 1024
+                                << " KB), " << std::fixed
+                                << std::setprecision(1) << margin
+                                << "% FIFO margin, " << std::setprecision(1)
+                                << 100 * result.cpu_seconds / result.seconds
+                                << "% CPU, " << std::setprecision(0)
+                                << result.context_switches / result.seconds
+                                << " context switches/s." << std::endl;
+                        found = true;
+                        break;
+                    }
+                }
+                if (!found) {
+                    summary << name << " (" << topology
+                            << "): no tried depth survived with " << size
+                            << " byte transfers." << std::endl;
+                }
+            }
+        }
+    }
+    std::cout << std::endl << summary.str();
+    return 0;
+}
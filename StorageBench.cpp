@@ -0,0 +1,291 @@
+// SiGeStorageBench qualifies a card for recording in minutes. It replays the
+// recorder's writes, packed IF buffers handed to a FileIFSink, against a
+// directory on the card, for every combination of the writer's settings
+// (--ifwritekb, --ifdirect, --ifsync) given.
+//
+// Each configuration runs twice for --seconds. Flat out, to measure the
+// sustained rate (including the final sync) and the latency of every Write,
+// which is how long the recorder's writer thread is held; Writes slower than
+// --stallms are counted as garbage collection stalls. Then paced at the
+// fastest devmode's rate, like the recorder, to measure the largest backlog
+// the stalls build up, i.e. how much packed IF data waits in memory.
+//
+// It then recommends the configuration with the smallest backlog among
+// those fast enough, and gives a pass/fail verdict for each devmode.
+
+#include "IFSink.h"
+#include "SiGeModes.h"
+
+#include <algorithm>
+#include <chrono>
+#include <fcntl.h>
+#include <gflags/gflags.h>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+DEFINE_string(path, ".", "Directory on the card to test.");
+static bool ValidateSeconds(const char *flagname, uint32_t seconds) {
+    if (seconds > 0) {
+        return true;
+    }
+    std::cerr << "--" << flagname << " must not be 0." << std::endl;
+    return false;
+}
+
+DEFINE_uint32(seconds, 10, "Duration of each run, two per configuration.");
+DEFINE_validator(seconds, ValidateSeconds);
+DEFINE_uint32(buffer, 4096,
+              "Size of the packed buffers the writer gets: --transfersize / 4 for real modes, / 2 for complex ones.");
+DEFINE_string(writekb, "0,64,1024",
+              "Comma separated --ifwritekb values to try.");
+DEFINE_string(direct, "false,true", "Comma separated --ifdirect values to try.");
+DEFINE_string(sync, "none,range",
+              "Comma separated --ifsync values to try: none, range, data.");
+DEFINE_uint32(syncmb, 8, "--ifsyncmb of the configurations that sync.");
+DEFINE_uint32(stallms, 50, "Writes slower than this count as stalls.");
+DEFINE_double(margin, 1.5,
+              "Sustained rate needed, as a multiple of the devmode's rate.");
+DEFINE_uint32(maxbacklogmb, 32,
+              "Largest backlog of packed IF data a passing configuration may build up.");
+
+namespace {
+    std::vector<std::string> SplitList(const std::string &list) {
+        std::vector<std::string> items;
+        std::stringstream ss(list);
+        std::string item;
+        while (std::getline(ss, item, ',')) {
+            items.push_back(item);
+        }
+        return items;
+    }
+
+    struct Config {
+        unsigned write_kb;
+        bool direct;
+        std::string sync;
+    };
+
+    struct Result {
+        double mb_per_s;
+        // Write latencies in ms.
+        double p50;
+        double p99;
+        double p999;
+        double max;
+        double stalls_per_minute;
+        double backlog_mb;
+    };
+
+    // Packed IF bytes per second.
+    double Rate(const SiGeMode &mode) {
+        return mode.sample_rate / mode.pack_mode;
+    }
+
+    FileIFSink::Options MakeOptions(const Config &config) {
+        FileIFSink::Options options;
+        options.write_size = config.write_kb * 1024;
+        options.direct = config.direct;
+        options.sync = config.sync == "range" ? FileIFSink::Sync::kRange
+                       : config.sync == "data" ? FileIFSink::Sync::kData
+                       : FileIFSink::Sync::kNone;
+        options.sync_size = std::max(FLAGS_syncmb, 1u) << 20;
+        return options;
+    }
+
+    std::string FlagsOf(const Config &config) {
+        std::ostringstream flags;
+        flags << "--ifwritekb " << config.write_kb << " --ifdirect="
+              << (config.direct ? "true" : "false") << " --ifsync "
+              << config.sync;
+        if (config.sync != "none") {
+            flags << " --ifsyncmb " << FLAGS_syncmb;
+        }
+        return flags.str();
+    }
+
+    // Until the data is on the card, not only in the page cache.
+    void SyncFile(const std::string &path) {
+        int fd = open(path.c_str(), O_WRONLY | O_CLOEXEC);
+        if (fd >= 0) {
+            fdatasync(fd);
+            close(fd);
+        }
+    }
+
+    Result Run(const Config &config, const std::vector<uint8_t> &buffer,
+               double paced_rate) {
+        using Clock = std::chrono::steady_clock;
+        const std::string path = FLAGS_path + "/sige_storage_bench.tmp";
+        const auto duration = std::chrono::seconds(FLAGS_seconds);
+        Result result;
+
+        // Flat out.
+        std::vector<double> latencies;
+        uint64_t written = 0;
+        auto start = Clock::now();
+        {
+            FileIFSink sink(path, false /* circular */, 0,
+                            MakeOptions(config));
+            while (Clock::now() - start < duration) {
+                auto before = Clock::now();
+                sink.Write(buffer.data(), buffer.size());
+                latencies.push_back(std::chrono::duration<double, std::milli>(
+                        Clock::now() - before).count());
+                written += buffer.size();
+            }
+        }
+        SyncFile(path);
+        double seconds = std::chrono::duration<double>(
+                Clock::now() - start).count();
+        unlink(path.c_str());
+
+        result.mb_per_s = written / seconds / 1e6;
+        std::sort(latencies.begin(), latencies.end());
+        auto percentile = [&latencies](double p) {
+            return latencies[std::min(latencies.size() - 1,
+                                      static_cast<size_t>(
+                                              p * latencies.size()))];
+        };
+        result.p50 = percentile(0.5);
+        result.p99 = percentile(0.99);
+        result.p999 = percentile(0.999);
+        result.max = latencies.back();
+        auto stalls = latencies.end() -
+                      std::upper_bound(latencies.begin(), latencies.end(),
+                                       static_cast<double>(FLAGS_stallms));
+        result.stalls_per_minute = stalls * 60.0 / seconds;
+
+        // Paced: data arrives at paced_rate, the writer catches up after a
+        // stall by writing back to back.
+        double backlog_max = 0;
+        written = 0;
+        start = Clock::now();
+        {
+            FileIFSink sink(path, false /* circular */, 0,
+                            MakeOptions(config));
+            for (auto now = start; now - start < duration; now = Clock::now()) {
+                double due = paced_rate *
+                             std::chrono::duration<double>(now - start).count();
+                double backlog = due - written;
+                backlog_max = std::max(backlog_max, backlog);
+                if (backlog >= buffer.size()) {
+                    sink.Write(buffer.data(), buffer.size());
+                    written += buffer.size();
+                } else {
+                    std::this_thread::sleep_for(std::chrono::duration<double>(
+                            (buffer.size() - backlog) / paced_rate));
+                }
+            }
+        }
+        unlink(path.c_str());
+        result.backlog_mb = backlog_max / 1e6;
+        return result;
+    }
+
+    bool IsFastEnough(const Result &result, double rate) {
+        return result.mb_per_s * 1e6 >= FLAGS_margin * rate &&
+               result.backlog_mb <= FLAGS_maxbacklogmb;
+    }
+}  // namespace
+
+int main(int argc, char *argv[]) {
+    gflags::SetUsageMessage(
+            "Measures how the IF writer does on a card and recommends its settings.");
+    gflags::ParseCommandLineFlags(&argc, &argv, true);
+    if (FLAGS_buffer == 0) {
+        std::cerr << "--buffer must not be 0." << std::endl;
+        return 1;
+    }
+
+    std::vector<Config> configs;
+    for (const auto &write_kb : SplitList(FLAGS_writekb)) {
+        for (const auto &direct : SplitList(FLAGS_direct)) {
+            for (const auto &sync : SplitList(FLAGS_sync)) {
+                if (sync != "none" && sync != "range" && sync != "data") {
+                    std::cerr << "Unknown sync policy " << sync << "."
+                              << std::endl;
+                    return 1;
+                }
+                configs.push_back({static_cast<unsigned>(std::stoul(write_kb)),
+                                   direct == "true" || direct == "1", sync});
+            }
+        }
+    }
+
+    std::vector<const SiGeMode *> modes;
+    double fastest_rate = 0;
+    for (unsigned devmode = 1; FindSiGeMode(devmode) != nullptr; ++devmode) {
+        modes.push_back(FindSiGeMode(devmode));
+        fastest_rate = std::max(fastest_rate, Rate(*modes.back()));
+    }
+
+    std::vector<uint8_t> buffer(FLAGS_buffer);
+    std::mt19937 generator(1);
+    for (auto &byte : buffer) {
+        byte = static_cast<uint8_t>(generator());
+    }
+
+    std::cout << "Paced runs at " << std::fixed << std::setprecision(2)
+              << fastest_rate / 1e6 << " MB/s, "
+              << configs.size() * 2 * FLAGS_seconds << " s to go." << std::endl
+              << "writekb direct sync    MB/s   p50ms   p99ms p99.9ms   "
+                 "maxms stalls/min backlogMB" << std::endl;
+    std::vector<Result> results;
+    for (const auto &config : configs) {
+        Result result = Run(config, buffer, fastest_rate);
+        results.push_back(result);
+        std::cout << std::setw(7) << config.write_kb << std::setw(7)
+                  << (config.direct ? "on" : "off") << " " << std::left
+                  << std::setw(6) << config.sync << std::right
+                  << std::setprecision(2) << std::setw(7) << result.mb_per_s
+                  << std::setw(8) << result.p50 << std::setw(8) << result.p99
+                  << std::setw(8) << result.p999 << std::setw(8) << result.max
+                  << std::setw(11) << std::setprecision(1)
+                  << result.stalls_per_minute << std::setw(10)
+                  << std::setprecision(2) << result.backlog_mb << std::endl;
+    }
+
+    // The smallest backlog among the configurations fast enough for the
+    // fastest devmode, the slowest writes break ties.
+    int best = -1;
+    for (size_t i = 0; i < results.size(); ++i) {
+        if (IsFastEnough(results[i], fastest_rate) &&
+            (best < 0 || results[i].backlog_mb < results[best].backlog_mb ||
+             (results[i].backlog_mb == results[best].backlog_mb &&
+              results[i].max < results[best].max))) {
+            best = static_cast<int>(i);
+        }
+    }
+    std::cout << std::endl;
+    if (best >= 0) {
+        std::cout << "Recommended writer configuration: "
+                  << FlagsOf(configs[best]) << std::endl;
+    } else {
+        std::cout << "No tried configuration keeps up with the fastest devmode."
+                  << std::endl;
+    }
+
+    // Backlogs were measured at the fastest rate, slower modes do no worse.
+    for (const auto *mode : modes) {
+        const double rate = Rate(*mode);
+        int passing = best >= 0 ? best : -1;
+        for (size_t i = 0; i < results.size() && passing < 0; ++i) {
+            if (IsFastEnough(results[i], rate)) {
+                passing = static_cast<int>(i);
+            }
+        }
+        std::cout << "devmode " << static_cast<int>(mode->devmode) << ": "
+                  << std::setprecision(2) << rate / 1e6 << " MB/s, "
+                  << (passing >= 0 ? "PASS" : "FAIL");
+        if (passing >= 0) {
+            std::cout << " (e.g. " << FlagsOf(configs[passing]) << ")";
+        }
+        std::cout << std::endl;
+    }
+    return best >= 0 ? 0 : 1;
+}
@@ -0,0 +1,169 @@
+// SiGeTraceToJson converts a trace dump written by the Tracer into Chrome
+// trace event JSON, which chrome://tracing and https://ui.perfetto.dev open.
+//
+// Begin/end events become slices on their thread's track, queue pushes and
+// pops become counter tracks of the queue depth, and transfer completions and
+// resubmissions become instant events.
+
+#include "Tracer.h"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <vector>
+
+namespace {
+    struct Thread {
+        uint16_t index;
+        std::string name;
+        std::vector<TraceRecord> records;
+    };
+
+    template<typename T>
+    bool Get(std::ifstream &file, T *value) {
+        return static_cast<bool>(
+                file.read(reinterpret_cast<char *>(value), sizeof(T)));
+    }
+
+    std::string Escape(const std::string &text) {
+        std::string escaped;
+        for (char c : text) {
+            if (c == '"' || c == '\\') {
+                escaped += '\\';
+            }
+            if (static_cast<unsigned char>(c) >= 0x20) {
+                escaped += c;
+            }
+        }
+        return escaped;
+    }
+}  // namespace
+
+int main(int argc, char *argv[]) {
+    if (argc != 3) {
+        std::cerr << "Usage: " << argv[0] << " <trace dump> <output.json>"
+                  << std::endl;
+        return 1;
+    }
+
+    std::ifstream file(argv[1], std::ios_base::in | std::ios_base::binary);
+    char magic[4];
+    uint32_t version = 0;
+    if (!file.read(magic, sizeof(magic)) || memcmp(magic, "VTRC", 4) != 0 ||
+        !Get(file, &version) || version != Tracer::kDumpVersion) {
+        std::cerr << argv[1] << " is not a trace dump." << std::endl;
+        return 1;
+    }
+    uint32_t reason_length = 0;
+    Get(file, &reason_length);
+    std::string reason(reason_length, '\0');
+    file.read(&reason[0], reason_length);
+    uint32_t thread_count = 0;
+    Get(file, &thread_count);
+
+    std::vector<Thread> threads(thread_count);
+    uint64_t origin = UINT64_MAX;
+    for (auto &thread : threads) {
+        uint16_t name_length = 0;
+        uint32_t record_count = 0;
+        Get(file, &thread.index);
+        Get(file, &name_length);
+        thread.name.resize(name_length);
+        file.read(&thread.name[0], name_length);
+        Get(file, &record_count);
+        thread.records.resize(record_count);
+        file.read(reinterpret_cast<char *>(thread.records.data()),
+                  record_count * sizeof(TraceRecord));
+        if (!file) {
+            std::cerr << argv[1] << " is truncated." << std::endl;
+            return 1;
+        }
+        for (const auto &record : thread.records) {
+            origin = std::min(origin, record.timestamp_ns);
+        }
+    }
+
+    std::ofstream out(argv[2]);
+    if (!out.is_open()) {
+        std::cerr << "Couldn't open " << argv[2] << "." << std::endl;
+        return 1;
+    }
+    out << "{\"otherData\":{\"reason\":\"" << Escape(reason)
+        << "\"},\"traceEvents\":[" << std::endl;
+    out << std::fixed << std::setprecision(3);
+    bool first = true;
+    auto separator = [&out, &first]() {
+        out << (first ? "" : ",\n");
+        first = false;
+    };
+    size_t count = 0;
+    for (const auto &thread : threads) {
+        separator();
+        out << "{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":1,\"tid\":"
+            << thread.index << ",\"args\":{\"name\":\"" << Escape(thread.name)
+            << "\"}}";
+        // A slice whose begin was overwritten would end nothing, skip ends
+        // until the first begin of each kind.
+        std::vector<bool> open(static_cast<size_t>(TraceEvent::kCount), false);
+        for (const auto &record : thread.records) {
+            const double ts = (record.timestamp_ns - origin) / 1e3;
+            const auto event = static_cast<TraceEvent>(record.event);
+            const char *name = Tracer::EventName(record.event);
+            separator();
+            switch (event) {
+                case TraceEvent::kPackBegin:
+                case TraceEvent::kWriteBegin:
+                case TraceEvent::kFlushBegin:
+                case TraceEvent::kAGCPollBegin:
+                case TraceEvent::kModeChangeBegin:
+                    open[record.event] = true;
+                    out << "{\"ph\":\"B\",\"name\":\"" << name
+                        << "\",\"pid\":1,\"tid\":" << thread.index
+                        << ",\"ts\":" << ts << ",\"args\":{\"arg\":"
+                        << record.arg << "}}";
+                    break;
+                case TraceEvent::kPackEnd:
+                case TraceEvent::kWriteEnd:
+                case TraceEvent::kFlushEnd:
+                case TraceEvent::kAGCPollEnd:
+                case TraceEvent::kModeChangeEnd:
+                    if (!open[record.event - 1]) {
+                        out << "{\"ph\":\"i\",\"s\":\"t\",\"name\":\"" << name
+                            << " (end)\",\"pid\":1,\"tid\":" << thread.index
+                            << ",\"ts\":" << ts << "}";
+                        break;
+                    }
+                    out << "{\"ph\":\"E\",\"name\":\"" << name
+                        << "\",\"pid\":1,\"tid\":" << thread.index
+                        << ",\"ts\":" << ts << ",\"args\":{\"arg\":"
+                        << record.arg << "}}";
+                    break;
+                case TraceEvent::kUnpackedQueuePush:
+                case TraceEvent::kUnpackedQueuePop:
+                case TraceEvent::kPackedQueuePush:
+                case TraceEvent::kPackedQueuePop: {
+                    bool unpacked = event == TraceEvent::kUnpackedQueuePush ||
+                                    event == TraceEvent::kUnpackedQueuePop;
+                    out << "{\"ph\":\"C\",\"name\":\""
+                        << (unpacked ? "UnpackedQueue" : "PackedQueue")
+                        << "\",\"pid\":1,\"ts\":" << ts
+                        << ",\"args\":{\"depth\":" << record.arg << "}}";
+                    break;
+                }
+                default:
+                    out << "{\"ph\":\"i\",\"s\":\"t\",\"name\":\"" << name
+                        << "\",\"pid\":1,\"tid\":" << thread.index
+                        << ",\"ts\":" << ts << ",\"args\":{\"bytes\":"
+                        << record.arg << "}}";
+                    break;
+            }
+            ++count;
+        }
+    }
+    out << "\n]}" << std::endl;
+    std::cerr << count << " events from " << threads.size()
+              << " threads written to " << argv[2] << "." << std::endl;
+    return 0;
+}
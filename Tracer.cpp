@@ -0,0 +1,235 @@
+#include "Tracer.h"
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace {
+    struct TraceBuffer {
+        uint16_t thread;
+        std::string name;
+        std::vector<TraceRecord> records;
+        // Number of records ever written, the next one goes to
+        // records[head % size].
+        std::atomic<uint64_t> head;
+    };
+
+    std::mutex mutex;
+    std::vector<std::unique_ptr<TraceBuffer>> buffers;
+    // Buffers of threads that exited, for the next threads to reuse. Their
+    // events are dumped until then.
+    std::vector<TraceBuffer *> free_buffers;
+    size_t capacity = 0;
+    uint64_t keep_ns = 0;
+    uint64_t enabled_since_ns = 0;
+    std::string dump_path;
+    std::atomic<bool> dumped(false);
+    // Checked by Record, a plain pointer costs nothing to get at.
+    thread_local TraceBuffer *thread_buffer = nullptr;
+    thread_local std::string thread_name;
+
+    // Gives the thread's buffer back when the thread exits.
+    struct BufferOwner {
+        TraceBuffer *buffer = nullptr;
+
+        ~BufferOwner() {
+            if (buffer != nullptr) {
+                std::lock_guard<std::mutex> lock(mutex);
+                free_buffers.push_back(buffer);
+                thread_buffer = nullptr;
+            }
+        }
+    };
+    thread_local BufferOwner buffer_owner;
+
+    const char *const kEventNames[] = {
+            "TransferComplete", "TransferResubmit", "UnpackedQueuePush",
+            "UnpackedQueuePop", "PackedQueuePush", "PackedQueuePop", "Pack",
+            "Pack", "Write", "Write", "Flush", "Flush", "AGCPoll", "AGCPoll",
+            "ModeChange", "ModeChange",
+    };
+    static_assert(sizeof(kEventNames) / sizeof(kEventNames[0]) ==
+                  static_cast<size_t>(TraceEvent::kCount),
+                  "Every trace event needs a name.");
+
+    uint64_t NowNs() {
+        return static_cast<uint64_t>(
+                std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        std::chrono::steady_clock::now().time_since_epoch())
+                        .count());
+    }
+
+    TraceBuffer *RegisterThread() {
+        std::lock_guard<std::mutex> lock(mutex);
+        TraceBuffer *buffer;
+        if (!free_buffers.empty()) {
+            buffer = free_buffers.back();
+            free_buffers.pop_back();
+        } else {
+            // The lowest index no buffer has, Enable drops buffers.
+            std::vector<bool> used(buffers.size() + 1);
+            for (const auto &other : buffers) {
+                if (other->thread < used.size()) {
+                    used[other->thread] = true;
+                }
+            }
+            uint16_t thread = 0;
+            while (used[thread]) {
+                ++thread;
+            }
+            buffers.emplace_back(new TraceBuffer);
+            buffer = buffers.back().get();
+            buffer->thread = thread;
+            buffer->records.resize(capacity);
+        }
+        buffer->name = thread_name.empty()
+                       ? "thread " + std::to_string(buffer->thread)
+                       : thread_name;
+        buffer->head = 0;
+        buffer_owner.buffer = buffer;
+        return buffer;
+    }
+}  // namespace
+
+std::atomic<bool> Tracer::enabled(false);
+
+void Tracer::Enable(size_t records_per_thread, double seconds,
+                    const std::string &path) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (enabled) {
+        return;
+    }
+    // Buffers of threads that exited since the last run are dropped.
+    // Threads still holding a buffer from a previous run keep it; its size
+    // doesn't change.
+    for (TraceBuffer *buffer : free_buffers) {
+        buffers.erase(std::find_if(
+                buffers.begin(), buffers.end(),
+                [buffer](const std::unique_ptr<TraceBuffer> &other) {
+                    return other.get() == buffer;
+                }));
+    }
+    free_buffers.clear();
+    if (capacity == 0) {
+        capacity = 1;
+        while (capacity < records_per_thread) {
+            capacity *= 2;
+        }
+    }
+    keep_ns = static_cast<uint64_t>(seconds * 1e9);
+    enabled_since_ns = NowNs();
+    dump_path = path;
+    dumped = false;
+    enabled = true;
+}
+
+void Tracer::Disable() {
+    enabled = false;
+}
+
+void Tracer::SetThreadName(const std::string &name) {
+    thread_name = name;
+    if (thread_buffer != nullptr) {
+        std::lock_guard<std::mutex> lock(mutex);
+        thread_buffer->name = name;
+    }
+}
+
+void Tracer::Record(TraceEvent event, uint32_t arg) {
+    TraceBuffer *buffer = thread_buffer;
+    if (buffer == nullptr) {
+        buffer = thread_buffer = RegisterThread();
+    }
+    uint64_t head = buffer->head.load(std::memory_order_relaxed);
+    TraceRecord &record = buffer->records[head & (capacity - 1)];
+    record.timestamp_ns = NowNs();
+    record.arg = arg;
+    record.event = static_cast<uint16_t>(event);
+    record.thread = buffer->thread;
+    buffer->head.store(head + 1, std::memory_order_release);
+}
+
+void Tracer::Dump(const std::string &reason) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (dump_path.empty() || dumped.exchange(true)) {
+        return;  // Never enabled, or already dumped.
+    }
+    // Buffers of threads from a previous recording are still around, their
+    // events don't belong in this dump.
+    // The clock may not have run for keep_ns yet, right after boot.
+    const uint64_t now = NowNs();
+    const uint64_t oldest = std::max(now > keep_ns ? now - keep_ns : 0,
+                                     enabled_since_ns);
+
+    std::ofstream file(dump_path, std::ios_base::out | std::ios_base::binary);
+    if (!file.is_open()) {
+        std::cerr << time(nullptr) << " Couldn't open trace dump "
+                  << dump_path << "." << std::endl;
+        return;
+    }
+    auto put = [&file](const void *data, size_t size) {
+        file.write(static_cast<const char *>(data), size);
+    };
+    uint32_t version = kDumpVersion;
+    uint32_t reason_length = static_cast<uint32_t>(reason.size());
+    put("VTRC", 4);
+    put(&version, sizeof(version));
+    put(&reason_length, sizeof(reason_length));
+    put(reason.data(), reason.size());
+
+    std::vector<std::pair<const TraceBuffer *, std::vector<TraceRecord>>>
+            threads;
+    for (const auto &buffer : buffers) {
+        // The owner keeps writing while we copy. Whatever it may have
+        // overwritten in the meantime, judging by its head afterwards, is
+        // thrown away.
+        uint64_t head = buffer->head.load(std::memory_order_acquire);
+        uint64_t first = head > capacity ? head - capacity : 0;
+        std::vector<TraceRecord> records;
+        records.reserve(head - first);
+        for (uint64_t i = first; i < head; ++i) {
+            records.push_back(buffer->records[i & (capacity - 1)]);
+        }
+        // The record at new_head may be half written, it shares its slot
+        // with new_head - capacity.
+        uint64_t new_head = buffer->head.load(std::memory_order_acquire);
+        uint64_t valid = new_head >= capacity ? new_head - capacity + 1 : 0;
+        std::vector<TraceRecord> kept;
+        for (uint64_t i = std::max(first, valid); i < head; ++i) {
+            const TraceRecord &record = records[i - first];
+            if (record.timestamp_ns >= oldest) {
+                kept.push_back(record);
+            }
+        }
+        if (!kept.empty()) {
+            threads.emplace_back(buffer.get(), std::move(kept));
+        }
+    }
+
+    uint32_t thread_count = static_cast<uint32_t>(threads.size());
+    put(&thread_count, sizeof(thread_count));
+    for (const auto &thread : threads) {
+        const TraceBuffer *buffer = thread.first;
+        const std::vector<TraceRecord> &kept = thread.second;
+        uint16_t name_length = static_cast<uint16_t>(buffer->name.size());
+        uint32_t record_count = static_cast<uint32_t>(kept.size());
+        put(&buffer->thread, sizeof(buffer->thread));
+        put(&name_length, sizeof(name_length));
+        put(buffer->name.data(), name_length);
+        put(&record_count, sizeof(record_count));
+        put(kept.data(), kept.size() * sizeof(TraceRecord));
+    }
+    std::cerr << time(nullptr) << " Trace dumped to " << dump_path << " ("
+              << reason << ")." << std::endl;
+}
+
+const char *Tracer::EventName(uint16_t event) {
+    if (event >= static_cast<uint16_t>(TraceEvent::kCount)) {
+        return "Unknown";
+    }
+    return kEventNames[event];
+}
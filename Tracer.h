@@ -0,0 +1,82 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+// Hot path events recorded by the Tracer. The meaning of the argument is
+// given for each event.
+enum class TraceEvent : uint16_t {
+    kTransferComplete,  // Transfer completion seen by the callback; bytes.
+    kTransferResubmit,  // Transfer handed back to libusb; bytes.
+    kUnpackedQueuePush,  // Unpacked IF queue; depth after the push.
+    kUnpackedQueuePop,  // Unpacked IF queue; depth after the pop.
+    kPackedQueuePush,  // Packed IF queue; depth after the push.
+    kPackedQueuePop,  // Packed IF queue; depth after the pop.
+    kPackBegin,  // Unpacked bytes.
+    kPackEnd,  // Packed bytes.
+    kWriteBegin,  // Bytes handed to the IF sinks.
+    kWriteEnd,  // Bytes handed to the IF sinks.
+    kFlushBegin,  // IF file flush; 0.
+    kFlushEnd,  // IF file flush; 0.
+    kAGCPollBegin,  // AGC and overrun status poll; 0.
+    kAGCPollEnd,  // AGC samples read.
+    kModeChangeBegin,  // Live devmode change; new devmode.
+    kModeChangeEnd,  // Live devmode change; new devmode.
+    kCount
+};
+
+// One event, as stored in memory and in dump files.
+struct TraceRecord {
+    uint64_t timestamp_ns;  // steady_clock.
+    uint32_t arg;
+    uint16_t event;
+    uint16_t thread;
+};
+
+// The Tracer keeps the last events of every thread that records any, in a
+// ring per thread, so that recording is a handful of stores with no lock and
+// no sharing between threads. It is a flight recorder: when something goes
+// wrong (and when recording stops), the events of the last few seconds are
+// dumped to a binary file, which SiGeTraceToJson turns into Chrome/Perfetto
+// trace JSON.
+//
+// Dump file layout (native endianness):
+//   char[4] "VTRC", uint32 version, uint32 reason length, reason,
+//   uint32 thread count, then per thread:
+//     uint16 thread index, uint16 name length, name,
+//     uint32 record count, TraceRecord[record count].
+class Tracer {
+
+public:
+    static constexpr uint32_t kDumpVersion = 1;
+
+    // Starts recording. records_per_thread is rounded up to a power of two.
+    // Dumps keep the last `seconds` of events and go to dump_path.
+    static void Enable(size_t records_per_thread, double seconds,
+                       const std::string &dump_path);
+
+    static void Disable();
+
+    // Names the calling thread in dumps.
+    static void SetThreadName(const std::string &name);
+
+    static void Record(TraceEvent event, uint32_t arg);
+
+    // Writes the recent events of all threads to the dump path. Only the first
+    // dump after Enable happens, later ones would only overwrite the events
+    // around the original problem.
+    static void Dump(const std::string &reason);
+
+    static const char *EventName(uint16_t event);
+
+    // Checked inline by TRACE_EVENT, so that a disabled tracer costs a load.
+    static std::atomic<bool> enabled;
+};
+
+#define TRACE_EVENT(event, arg)                                                  \
+    do{                                                                          \
+        if (Tracer::enabled.load(std::memory_order_relaxed)) {                   \
+            Tracer::Record(event, static_cast<uint32_t>(arg));                   \
+        }                                                                        \
+    } while(0)
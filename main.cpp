@@ -1,12 +1,15 @@
-#include <chrono>
+#include <algorithm>
 #include <iostream>
 #include <libusb-1.0/libusb.h>
 #include <csignal>
 #include <gflags/gflags.h>
 #include <memory>
+#include <sstream>
+#include <sys/epoll.h>
 #include <unistd.h>
 
 #include "AGCMonitor.h"
+#include "Reactor.h"
 #include "RocketInterfaceMonitor.h"
 
 DEFINE_string(logname, "rec",
@@ -24,22 +27,87 @@ DEFINE_int32(devmode, 8,
              "Mode used to set up the frontend (please refer to http://ccar.colorado.edu/gnss).");
 DEFINE_validator(devmode, ValidateDevMode);
 
-volatile bool stop_signal_caught = false;
-
-//this function is called when SIGINT signal is received to clean up all dynamics allocations and terminate properly.
-//SIGINT can be received when Ctrl+C in a terminal
-void SIG_handler(int signum) {
-    if (signum == SIGINT || signum == SIGTERM)
-        stop_signal_caught = true;
+static bool ValidateTransferSize(const char *flagname, uint32_t size) {
+    if (size > 0 && size % 512 == 0) {   // Whole USB packets, packs evenly.
+        return true;
+    }
+    printf("Invalid value for --%s: %u, must be a multiple of 512\n", flagname,
+           size);
+    return false;
 }
 
+DEFINE_uint32(transfers, 768,
+              "Number of IF transfers kept queued, see SiGeSoak to pick a value.");
+DEFINE_uint32(transfersize, 16384,
+              "Size in bytes of each IF transfer buffer, a multiple of 512.");
+DEFINE_validator(transfersize, ValidateTransferSize);
+
+static bool ValidateModeSchedule(const char *flagname,
+                                 const std::string &schedule);
+
+DEFINE_string(modeschedule, "",
+              "Comma separated devmode changes while recording, <start|launch>+<seconds>:<devmode>, e.g. launch+0:1,launch+80:6,launch+600:1.");
+DEFINE_validator(modeschedule, ValidateModeSchedule);
+
 namespace {
+    // One entry of --modeschedule.
+    struct ModeSwitch {
+        bool after_launch;
+        double seconds;
+        unsigned char devmode;
+    };
+
+    bool ParseModeSchedule(const std::string &schedule,
+                           std::vector<ModeSwitch> *switches) {
+        std::stringstream ss(schedule);
+        std::string item;
+        while (std::getline(ss, item, ',')) {
+            auto plus = item.find('+');
+            auto colon = item.find(':');
+            if (plus == std::string::npos || colon == std::string::npos ||
+                colon < plus) {
+                return false;
+            }
+            std::string trigger = item.substr(0, plus);
+            ModeSwitch mode_switch;
+            try {
+                mode_switch.seconds = std::stod(
+                        item.substr(plus + 1, colon - plus - 1));
+                mode_switch.devmode = static_cast<unsigned char>(
+                        std::stoul(item.substr(colon + 1)));
+            } catch (const std::exception &) {
+                return false;
+            }
+            if ((trigger != "start" && trigger != "launch") ||
+                mode_switch.seconds < 0 || mode_switch.devmode < 1 ||
+                mode_switch.devmode > 8) {
+                return false;
+            }
+            mode_switch.after_launch = trigger == "launch";
+            switches->push_back(mode_switch);
+        }
+        return true;
+    }
+
     constexpr int64_t kRecordDurationSeconds = 60 * 60 * 2 + 60 * 30;
+    // Launch pin polling period when their edges aren't enabled.
+    constexpr double kLaunchPollSeconds = 0.01;
+}
+
+static bool ValidateModeSchedule(const char *flagname,
+                                 const std::string &schedule) {
+    std::vector<ModeSwitch> switches;
+    if (ParseModeSchedule(schedule, &switches)) {
+        return true;
+    }
+    printf("Invalid value for --%s: %s\n", flagname, schedule.c_str());
+    return false;
 }
 
 int main(int argc, char *argv[]) {
     usleep(10000000);
-    if (!devmode_validator_registered) {
+    if (!devmode_validator_registered || !transfersize_validator_registered ||
+        !modeschedule_validator_registered) {
         std::cerr << "There was a problem with gflags. Exiting." << std::endl;
         exit(1);
     }
@@ -47,8 +115,13 @@ int main(int argc, char *argv[]) {
     gflags::ParseCommandLineFlags(&argc, &argv, true);
 
     ///Signal handling SIGINT = Ctrl+C and SIGTERM is the default signal sent by KILL linux command, both will stop properly the programme
-    signal(SIGINT, SIG_handler);
-    signal(SIGTERM, SIG_handler);
+    //before any thread starts, so that they all leave the signals to the reactor
+    Reactor reactor;
+    reactor.WatchSignals({SIGINT, SIGTERM}, [&reactor](int signum) {
+        std::cerr << time(nullptr) << " Caught signal " << signum
+                  << ", stopping." << std::endl;
+        reactor.Stop();
+    });
     signal(SIGPIPE, SIG_IGN);
 
     ///Read args
@@ -67,35 +140,70 @@ int main(int argc, char *argv[]) {
 
     //set all parameters using args
     monitor.SetMode(static_cast<unsigned char>(devmode));
+    monitor.SetTransfers(std::max(FLAGS_transfers, 1u), FLAGS_transfersize);
     monitor.SetLogName(logname);
+    monitor.SetReactor(&reactor);
 
     //open device and start recording
     monitor.OpenDevice();
     monitor.StartRecording();
     rocket_monitor.SetStatus(true);
 
-    //enter a while waiting loop
-    while (!stop_signal_caught) {
-        if (rocket_monitor.IsLaunched()) {
-            break;
+    //schedule the mode changes, those after launch are armed at launch
+    std::vector<ModeSwitch> mode_switches;
+    ParseModeSchedule(FLAGS_modeschedule, &mode_switches);
+    auto schedule_mode_switches = [&](bool after_launch) {
+        for (const auto &mode_switch : mode_switches) {
+            if (mode_switch.after_launch == after_launch) {
+                unsigned char devmode = mode_switch.devmode;
+                reactor.AddTimer(mode_switch.seconds, false /* periodic */,
+                                 [&monitor, devmode] {
+                                     monitor.RequestModeChange(devmode);
+                                 });
+            }
         }
-        using namespace std::chrono_literals;
-        std::this_thread::sleep_for(10ms);
-    }
-
-    std::cerr << time(nullptr)  << " Detected launch." << std::endl;
-
-    auto start = std::chrono::system_clock::now();
-    while (!stop_signal_caught) {
-        auto end = std::chrono::system_clock::now();
-        if (std::chrono::duration_cast<std::chrono::seconds>(
-                end - start).count() >= kRecordDurationSeconds) {
-            stop_signal_caught = true;
-            std::cerr << time(nullptr) << " Time's up! Quitting." << std::endl;
+    };
+    schedule_mode_switches(false);
+
+    //wait for the launch, then for the end of the recording
+    std::vector<int> launch_fds = rocket_monitor.OpenLaunchPinEdges();
+    int launch_poll_timer = -1;
+    bool launched = false;
+    auto check_launch = [&]() {
+        if (launched || !rocket_monitor.IsLaunched()) {
+            return;
+        }
+        launched = true;
+        std::cerr << time(nullptr) << " Detected launch." << std::endl;
+        schedule_mode_switches(true);
+        for (int fd : launch_fds) {
+            reactor.Unwatch(fd);
+        }
+        if (launch_poll_timer >= 0) {
+            reactor.CancelTimer(launch_poll_timer);
+        }
+        reactor.AddTimer(kRecordDurationSeconds, false /* periodic */,
+                         [&reactor] {
+                             std::cerr << time(nullptr)
+                                       << " Time's up! Quitting." << std::endl;
+                             reactor.Stop();
+                         });
+    };
+    if (launch_fds.empty()) {
+        std::cerr << time(nullptr)
+                  << " Launch pin edges not enabled, polling them." << std::endl;
+        launch_poll_timer = reactor.AddTimer(kLaunchPollSeconds,
+                                             true /* periodic */, check_launch);
+    } else {
+        for (int fd : launch_fds) {
+            reactor.Watch(fd, EPOLLPRI | EPOLLERR, [fd, &check_launch](uint32_t) {
+                RocketInterfaceMonitor::ClearLaunchPinEdge(fd);
+                check_launch();
+            });
         }
-        using namespace std::chrono_literals;
-        std::this_thread::sleep_for(2s);
     }
+    check_launch();
+    reactor.Run();
 
     ///Terminate properly
     monitor.StopRecording();
@@ -11,6 +11,8 @@ gpio export 6 out
 gpio export 13 out
 gpio export 19 down
 gpio export 26 down
+gpio edge 19 both
+gpio edge 26 both
 
 nohup ./SiGeDumperLite-wiringPi --devmode 6 >sdl.log 2>&1 &
 echo PID=$!